@@ -1,4 +1,5 @@
 #include <string.h>
+#include <riscv_string.h>
 
 /* *
  * strlen - calculate the length of the string @s, not including
@@ -9,11 +10,15 @@
  * */
 size_t
 strlen(const char *s) {
+#ifdef __HAVE_ARCH_STRLEN
+    return __strlen(s);
+#else
     size_t cnt = 0;
     while (*s ++ != '\0') {
         cnt ++;
     }
     return cnt;
+#endif /* __HAVE_ARCH_STRLEN */
 }
 
 /* *
@@ -31,11 +36,15 @@ strlen(const char *s) {
  * */
 size_t
 strnlen(const char *s, size_t len) {
+#ifdef __HAVE_ARCH_STRNLEN
+    return __strnlen(s, len);
+#else
     size_t cnt = 0;
     while (cnt < len && *s ++ != '\0') {
         cnt ++;
     }
     return cnt;
+#endif /* __HAVE_ARCH_STRNLEN */
 }
 
 /* *
@@ -124,10 +133,14 @@ strcmp(const char *s1, const char *s2) {
  * */
 int
 strncmp(const char *s1, const char *s2, size_t n) {
+#ifdef __HAVE_ARCH_STRNCMP
+    return __strncmp(s1, s2, n);
+#else
     while (n > 0 && *s1 != '\0' && *s1 == *s2) {
         n --, s1 ++, s2 ++;
     }
     return (n == 0) ? 0 : (int)((unsigned char)*s1 - (unsigned char)*s2);
+#endif /* __HAVE_ARCH_STRNCMP */
 }
 
 /* *
@@ -140,6 +153,9 @@ strncmp(const char *s1, const char *s2, size_t n) {
  * */
 char *
 strchr(const char *s, char c) {
+#ifdef __HAVE_ARCH_STRCHR
+    return __strchr(s, c);
+#else
     while (*s != '\0') {
         if (*s == c) {
             return (char *)s;
@@ -147,6 +163,7 @@ strchr(const char *s, char c) {
         s ++;
     }
     return NULL;
+#endif /* __HAVE_ARCH_STRCHR */
 }
 
 /* *
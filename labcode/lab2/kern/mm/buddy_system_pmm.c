@@ -3,20 +3,102 @@
 #include <string.h>
 #include <buddy_system_pmm.h>
 #include <stdio.h>
+#include <dtb.h>
+#include <riscv.h>
 
-static free_area_t free_area[15];//声明15个空闲区域管理结构，对应伙伴系统的15个级别
+#define BUDDY_MAX_ORDER 25//free_area数组容量，最大块为2^24页(64GiB)，空闲位图用一个uint32_t即可容纳
+
+static free_area_t free_area[BUDDY_MAX_ORDER];//每个级别一个空闲区域管理结构
+static unsigned int max_order = 15;//实际使用的级别数，在init中根据DTB给出的内存大小确定
+static uint32_t free_bitmap = 0;//第i位为1表示第i级空闲链表非空，用于O(1)选择级别
 static struct Page *page_base = NULL;//保存整个页面数组的基地址指针，用作所有页面地址计算的参考点
+static size_t page_total = 0;//page_base开始被管理的页面数，合并时用来判断伙伴块是否越界
 static uint32_t nr_free = 0;//记录系统中所有空闲页面的总数量
+static bool buddy_exact_size = 1;//为1时只占用请求的n页，多出的尾部还给低级别链表(需DEFS=-DPMM_BUDDY才启用伙伴系统)
+static bool buddy_linear_scan = 0;//为1时退回逐级扫描选择级别，仅供buddy_check做延迟对比
 
 #define free_list(x) (free_area[x].free_list)
 #define nr_free(x) (free_area[x].nr_free)
 
+// 计算x末尾0的个数(x != 0)，用de Bruijn序列实现，避免依赖libgcc的__ctzdi2
+static inline unsigned int
+buddy_ctz(uint32_t x) {
+    static const uint8_t debruijn_index[32] = {
+        0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+        31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9,
+    };
+    return debruijn_index[((x & -x) * 0x077CB531U) >> 27];
+}
+
+// 返回满足2^order >= n的最小order，即ceil(log2(n))
+static inline unsigned int
+buddy_order(size_t n) {
+    if (n > (1U << (BUDDY_MAX_ORDER - 1))) {
+        return BUDDY_MAX_ORDER;
+    }
+    uint32_t v = n - 1;
+    v |= v >> 1, v |= v >> 2, v |= v >> 4, v |= v >> 8, v |= v >> 16;
+    return buddy_ctz(v + 1);
+}
+
+// 将块p作为第order级空闲块挂入链表，并维护计数和位图
+static inline void
+buddy_push(unsigned int order, struct Page *p) {
+    p->property = 1 << order;
+    SetPageProperty(p);
+    list_add_before(&free_list(order), &(p->page_link));
+    ++nr_free(order);
+    free_bitmap |= 1U << order;
+}
+
+// 将第order级空闲块p从链表中摘下，链表空了就清掉位图中对应的位
+static inline void
+buddy_remove(unsigned int order, struct Page *p) {
+    list_del(&(p->page_link));
+    if (--nr_free(order) == 0) {
+        free_bitmap &= ~(1U << order);
+    }
+}
+
+// 找到能满足n页请求的最小非空级别，找不到返回-1
+static int
+buddy_find_order(size_t n) {
+    unsigned int order = buddy_order(n);
+    if (order >= max_order) {
+        return -1;
+    }
+    if (buddy_linear_scan) {//原来的逐级扫描实现，从第0级开始找
+        for (int i = 0; i < max_order; ++i) {
+            if (n <= (1 << i) && nr_free(i)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    uint32_t mask = free_bitmap & ~((1U << order) - 1);//屏蔽掉块太小的级别
+    return mask ? buddy_ctz(mask) : -1;
+}
+
 static void
 buddy_system_init(void) {
-    for(int i = 0; i < 15; ++i) {
+    // 能出现的最大块不超过总页数-1，级别数取(总页数-1)的二进制位数:128MiB时为15级(0~14)
+    size_t mem_pages = get_memory_size() / PGSIZE;
+    if (mem_pages > 1) {
+        max_order = 0;
+        for (size_t v = mem_pages - 1; v; v >>= 1) {
+            ++max_order;
+        }
+        if (max_order > BUDDY_MAX_ORDER) {
+            max_order = BUDDY_MAX_ORDER;
+        }
+    }
+    for(int i = 0; i < BUDDY_MAX_ORDER; ++i) {
         list_init(&free_list(i));
         nr_free(i) = 0;
     }
+    free_bitmap = 0;
+    cprintf("buddy system: %u orders, max block %lu pages\n", max_order,
+            1UL << (max_order - 1));
 }
 
 static void
@@ -24,18 +106,20 @@ buddy_system_init_memmap(struct Page *base, size_t n) {//定义伙伴系统内
     assert(n > 0);
     struct Page *p = base;
     page_base = base;//保存页面数组的基地址到全局变量
+    page_total = n;
     for (; p != base + n; p ++) {
         assert(PageReserved(p));
         p->flags = p->property = 0;// 清空页面的标志位和属性字段，重置页面状态
         set_page_ref(p, 0);
     }
     nr_free += n;//总空闲页增多
-    for(int i = 0; i < 15; ++i) if((n >> i) & 1) {
+    unsigned int top = max_order - 1;
+    for(int i = 0; i < top; ++i) if((n >> i) & 1) {
         struct Page *q = base + (n -= 1 << i);//计算当前要创建的空闲块起始位置，同时从n中减去块大小
-        q->property = 1 << i;
-        SetPageProperty(q);// 标记该页面为空闲块的头页面
-        list_add(&free_list(i), &(q->page_link));//将空闲块加入到第i级空闲链表中
-        ++ nr_free(i);//增加第i级空闲块的计数
+        buddy_push(i, q);//标记为空闲块头页面并加入第i级空闲链表
+    }
+    while (n) {//剩下的部分是最大块的整数倍
+        buddy_push(top, base + (n -= 1 << top));
     }
 }
 
@@ -45,59 +129,116 @@ buddy_system_alloc_pages(size_t n) {//定义伙伴系统分配函数，参数n
     if (n > nr_free) {
         return NULL;
     }
-    struct Page *page = NULL;//初始化页面指针为NULL，用于存储找到的空闲页面
-    uint8_t log = 0;//记录找到的空闲块的级别
-    for(int i = 0; i < 15; ++i) {
-        if(n <= (1 << i) && nr_free(i)) {//检查当前级别的块大小是否足够且该级别有空闲块可用
-            page = le2page(list_next(&free_list(log = i)), page_link);// 获取第i级空闲链表的第一个页面
-            break;
-        }
+    int found = buddy_find_order(n);//通过空闲位图直接定位最小的可用级别
+    if (found < 0) {
+        return NULL;
+    }
+    unsigned int log = found;//记录找到的空闲块的级别
+    struct Page *page = le2page(list_next(&free_list(log)), page_link);// 获取该级空闲链表的第一个页面
+    buddy_remove(log, page);//将找到的页面从空闲链表中移除
+    while(log && n <= (1 << (log - 1))) {// 当块可以继续分割且分割后仍能满足需求时进入分割循环
+        --log;//块大小减半
+        struct Page *p = page + (1 << log);//计算分割后右半部分（伙伴块）的起始页面地址
+        p->flags = 0;//清空伙伴块的标志位
+        set_page_ref(p, 0);//将伙伴块的引用计数设置为0
+        buddy_push(log, p);//伙伴块标记为空闲并加入对应级别的空闲链表
     }
-    if (page != NULL) {
-        list_del(&(page->page_link));//将找到的页面从空闲链表中移除
-        --nr_free(log);//将对应级别的空闲块计数减1
-        while(log && n <= (1 << (log - 1))) {// 当块可以继续分割且分割后仍能满足需求时进入分割循环
-            ++nr_free(--log);//块大小减半，同时增加新级别的空闲块计数
-            struct Page *p = page + (1 << log);//计算分割后右半部分（伙伴块）的起始页面地址
-            p->property = (1 << log);//设置伙伴块的大小属性为2^log页
-            p->flags = 0;//清空伙伴块的标志位
-            set_page_ref(p, 0);//将伙伴块的引用计数设置为0
-            SetPageProperty(p);//标记伙伴块为空闲状态
-            list_add_before(&free_list(log), &(p->page_link));//将伙伴块加入到对应级别的空闲链表中
+    if (buddy_exact_size) {
+        // 把[n, 2^log)这段用不到的尾部按对齐的2的幂拆开还回低级别链表，
+        // 每一块的伙伴都落在已分配部分里，所以这里不需要合并
+        for (size_t pos = n; pos < (1 << log); pos += 1 << buddy_ctz(pos)) {
+            struct Page *p = page + pos;
+            p->flags = 0;
+            set_page_ref(p, 0);
+            buddy_push(buddy_ctz(pos), p);
         }
-        nr_free -= 1 << log;//从总空闲页数中减去实际分配的页面数
-        page->property = 1 << log;//设置分配页面的大小属性为实际分配的页面数
-        ClearPageProperty(page);//清除分配页面的空闲标记，表示该页面已被分配
+    } else {
+        n = 1 << log;//整块分配出去
     }
+    nr_free -= n;//从总空闲页数中减去实际分配的页面数
+    page->property = n;//设置分配页面的大小属性为实际分配的页面数
+    ClearPageProperty(page);//清除分配页面的空闲标记，表示该页面已被分配
     return page;
 }
 
+// 释放page_id开始的一个第order级对齐块，并不断与空闲的伙伴合并
+static void
+buddy_free_block(size_t page_id, unsigned int order) {
+    for(; order + 1 < max_order; ++order) {
+        size_t buddy_page_id = page_id ^ (1 << order);
+        if (buddy_page_id + (1 << order) > page_total) {//伙伴块超出管理范围
+            break;
+        }
+        struct Page *buddy_page = page_base + buddy_page_id;
+        if(!PageProperty(buddy_page) || buddy_page->property != (1 << order)) {// 检查伙伴页面是否空闲
+            break;
+        }
+        buddy_remove(order, buddy_page);//将伙伴块从其所在的空闲链表中移除
+        ClearPageProperty(buddy_page);// 合并后只保留左半部分的空闲标记
+        if(buddy_page_id < page_id)
+            page_id = buddy_page_id;
+    }
+    buddy_push(order, page_base + page_id);//将合并后的块加入到第order级空闲链表中
+}
+
 static void
 buddy_system_free_pages(struct Page *base, size_t n) {//定义伙伴系统释放函数，参数base是要释放的页面起始地址，n是释放的页面数量
     assert(n > 0);
     size_t page_id = base - page_base;//计算要释放页面在整个页面数组中的索引ID
-    base->property = n;//设置释放块的大小属性为n页
-    SetPageProperty(base);//标记该页面为空闲块的头页面
+    size_t end = page_id + n;
+    assert(end <= page_total);
     nr_free += n;
+    // [page_id, end)不一定是一个完整的伙伴块(精确分配或部分释放)，
+    // 每次取起点处对齐且不越过end的最大块释放
+    while (page_id < end) {
+        unsigned int order = page_id ? buddy_ctz(page_id) : max_order - 1;
+        if (order > max_order - 1) {
+            order = max_order - 1;
+        }
+        while ((1 << order) > end - page_id) {
+            --order;
+        }
+        buddy_free_block(page_id, order);
+        page_id += 1 << order;
+    }
+}
 
-    for(int i = 0; i < 15; ++i) if((n >> i) & 1){
-        size_t buddy_page_id = page_id ^ (1 << i);
-        struct Page *buddy_page = page_base + buddy_page_id;
-        if(PageProperty(buddy_page) && buddy_page->property == base->property) {// 检查伙伴页面是否空闲
-            if(buddy_page_id < page_id)
-                page_id = buddy_page_id;
-            base = page_base + page_id;// 更新base指针指向合并后块的起始页面
-            base->property = 2 << i;
-            list_del(&(buddy_page->page_link));//将伙伴块从其所在的空闲链表中移除
-            --nr_free(i);
-            ClearPageProperty(base + (1 << i));// 清除合并块右半部分的空闲标记，只保留左半部分标记
-            n <<= 1;
-        } else {
-            list_add_before(&free_list(i), &(base->page_link));//将当前块加入到第i级空闲链表中
-            ++nr_free(i);
-            break;
+// 批量分配n个单页(不要求连续):从最小的非空级别开始整块取用，
+// 最后一块只取需要的部分，剩下的尾部照精确分配的方式还回去
+static size_t
+buddy_system_alloc_pages_bulk(size_t n, struct Page **array) {
+    size_t got = 0;
+    while (got < n && free_bitmap) {
+        unsigned int order = buddy_ctz(free_bitmap);
+        struct Page *page = le2page(list_next(&free_list(order)), page_link);
+        size_t take = (1 << order) < n - got ? (1 << order) : n - got;
+        buddy_remove(order, page);
+        for (size_t pos = take; pos < (1 << order); pos += 1 << buddy_ctz(pos)) {
+            struct Page *p = page + pos;
+            p->flags = 0;
+            set_page_ref(p, 0);
+            buddy_push(buddy_ctz(pos), p);
+        }
+        ClearPageProperty(page);
+        for (struct Page *p = page; p != page + take; p ++) {
+            p->property = 1;//每一页都是独立的单页分配
+            array[got ++] = p;
         }
     }
+    nr_free -= got;
+    return got;
+}
+
+// 批量释放单页:数组中地址连续的页面合成一段，按区间释放
+static void
+buddy_system_free_pages_bulk(struct Page **array, size_t n) {
+    size_t i = 0, j;
+    while (i < n) {
+        for (j = i + 1; j < n && array[j] == array[j - 1] + 1; j ++)
+            ;
+        buddy_system_free_pages(array[i], j - i);
+        i = j;
+    }
 }
 
 static size_t
@@ -105,6 +246,92 @@ buddy_system_nr_free_pages(void) {
     return nr_free;
 }
 
+#define BUDDY_BENCH_ROUNDS 10000
+
+// 测量BUDDY_BENCH_ROUNDS次alloc_pages(n)的总耗时(time计数)，每次分配后立即释放
+static uint64_t
+buddy_bench_alloc(size_t n) {
+    uint64_t cost = 0;
+    for (int r = 0; r < BUDDY_BENCH_ROUNDS; ++r) {
+        uint64_t start = rdtime();
+        struct Page *page = alloc_pages(n);
+        cost += rdtime() - start;
+        assert(page != NULL);
+        free_pages(page, page->property);
+    }
+    return cost;
+}
+
+// 对比位图选级与原来逐级扫描的分配延迟，两种方式分配结果必须一致
+static void
+buddy_bench(void) {
+    for (int i = 0; i < max_order; ++i) {//位图必须与各级空闲链表是否为空一致
+        assert(((free_bitmap >> i) & 1) != list_empty(&free_list(i)));
+    }
+    size_t sizes[] = {1, 4, 32};
+    for (int k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+        size_t total = buddy_system_nr_free_pages();
+        buddy_linear_scan = 1;
+        uint64_t linear = buddy_bench_alloc(sizes[k]);
+        buddy_linear_scan = 0;
+        uint64_t bitmap = buddy_bench_alloc(sizes[k]);
+        assert(total == buddy_system_nr_free_pages());
+        cprintf("buddy alloc_pages(%d) x %d: linear scan %lu ticks, bitmap %lu ticks\n",
+                sizes[k], BUDDY_BENCH_ROUNDS, linear, bitmap);
+    }
+}
+
+// 精确分配:只占用请求的页数，按任意切分释放后各级空闲块必须恢复原样
+// 由buddy_check调用，默认的best_fit不会走到这里，需用DEFS=-DPMM_BUDDY编译才在启动时运行
+static void
+buddy_exact_check(void) {
+    unsigned int nr_free_store[BUDDY_MAX_ORDER];
+    for (int i = 0; i < max_order; ++i) {
+        nr_free_store[i] = nr_free(i);
+    }
+    size_t total = buddy_system_nr_free_pages();
+    struct Page *p0, *p1, *p2;
+
+    assert((p0 = alloc_pages(33)) != NULL && p0->property == 33);
+    assert((p1 = alloc_pages(5)) != NULL && p1->property == 5);
+    assert(total - 38 == buddy_system_nr_free_pages());
+    assert((p2 = alloc_pages(31)) != NULL);
+    assert(p2 + 31 <= p0 || p2 >= p0 + 33);
+    free_pages(p2, 31);
+    free_pages(p0, 10);//分两次释放同一次分配的页面
+    free_pages(p0 + 10, 23);
+    free_pages(p1, 5);
+    assert(total == buddy_system_nr_free_pages());
+    for (int i = 0; i < max_order; ++i) {
+        assert(nr_free(i) == nr_free_store[i]);
+    }
+
+    buddy_exact_size = 0;//对比:2的幂取整模式下33页要占用64页
+    assert((p0 = alloc_pages(33)) != NULL && p0->property == 64);
+    assert(total - 64 == buddy_system_nr_free_pages());
+    free_pages(p0, p0->property);
+    buddy_exact_size = 1;
+    for (int i = 0; i < max_order; ++i) {
+        assert(nr_free(i) == nr_free_store[i]);
+    }
+
+    //批量分配单页，全部释放后同样要恢复原样
+    struct Page **bulk = KADDR(page2pa(p1 = alloc_page()));
+    assert(alloc_pages_bulk(100, bulk) == 100);
+    assert(total - 101 == buddy_system_nr_free_pages());
+    for (int i = 0; i < 100; ++i) {
+        assert(bulk[i]->property == 1 && !PageProperty(bulk[i]));
+        for (int j = i + 1; j < 100; ++j) {
+            assert(bulk[i] != bulk[j]);
+        }
+    }
+    free_pages_bulk(bulk, 100);
+    free_page(p1);
+    for (int i = 0; i < max_order; ++i) {
+        assert(nr_free(i) == nr_free_store[i]);
+    }
+}
+
 static void
 buddy_check(void) {
     struct Page *page1 = alloc_page(), *page4 = alloc_pages(4);
@@ -120,7 +347,7 @@ buddy_check(void) {
     assert(page2pa(p1) < npage * PGSIZE);
     assert((total -= 32) == buddy_system_nr_free_pages());
     int ul = 0;
-    for(int i = 15; ~i; --i) {
+    for(int i = max_order - 1; ~i; --i) {
         p0[i] = alloc_pages(1 << i);
         if(p0[i] == NULL) continue;
         assert(page_ref(p0[i]) == 0);
@@ -147,7 +374,7 @@ buddy_check(void) {
     assert(page2pa(p1) < npage * PGSIZE);
     assert((total -= p1->property) == buddy_system_nr_free_pages());
     assert(alloc_page() == NULL);
-    for(int i = 0; i <= 15; ++i) if(p0[i] != NULL) {
+    for(int i = 0; i < max_order; ++i) if(p0[i] != NULL) {
         total += 1 << i;
         assert(p0[i]->property == 1 << i);
         free_pages(p0[i], 1 << i);
@@ -221,6 +448,8 @@ buddy_check(void) {
         assert(total == buddy_system_nr_free_pages());
     }
     assert(total == tmp);
+    buddy_exact_check();
+    buddy_bench();
     cprintf("Buddy system checked!\n");
     free_page(page1);
     free_pages(page4, 4);
@@ -235,5 +464,7 @@ const struct pmm_manager buddy_system_pmm_manager = {
     .free_pages = buddy_system_free_pages,
     .nr_free_pages = buddy_system_nr_free_pages,
     .check = buddy_check,
+    .alloc_pages_bulk = buddy_system_alloc_pages_bulk,
+    .free_pages_bulk = buddy_system_free_pages_bulk,
 };
 
@@ -34,8 +34,15 @@ const struct pmm_manager *pmm_manager;
 static void check_alloc_page(void);
 
 // init_pmm_manager - initialize a pmm_manager instance
+// best_fit_pmm_manager by default; build with DEFS=-DPMM_BUDDY to run the
+// buddy system instead, check_alloc_page then runs buddy_check and its
+// benchmark at boot
 static void init_pmm_manager(void) {
+#ifdef PMM_BUDDY
+    pmm_manager = &buddy_system_pmm_manager;
+#else
     pmm_manager = &best_fit_pmm_manager;
+#endif
     cprintf("memory management: %s\n", pmm_manager->name);
     pmm_manager->init();
 }
@@ -56,6 +63,32 @@ void free_pages(struct Page *base, size_t n) {
     pmm_manager->free_pages(base, n);
 }
 
+// alloc_pages_bulk - call pmm->alloc_pages_bulk to allocate n single pages
+// (not necessarily contiguous) into array, falls back to alloc_pages(1) in a
+// loop if the manager has no bulk hook. return the number of pages allocated
+size_t alloc_pages_bulk(size_t n, struct Page **array) {
+    size_t got = 0;
+    if (pmm_manager->alloc_pages_bulk != NULL) {
+        return pmm_manager->alloc_pages_bulk(n, array);
+    }
+    while (got < n && (array[got] = pmm_manager->alloc_pages(1)) != NULL) {
+        got++;
+    }
+    return got;
+}
+
+// free_pages_bulk - call pmm->free_pages_bulk to free the n single pages in
+// array, falls back to free_pages(p, 1) in a loop
+void free_pages_bulk(struct Page **array, size_t n) {
+    if (pmm_manager->free_pages_bulk != NULL) {
+        pmm_manager->free_pages_bulk(array, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        pmm_manager->free_pages(array[i], 1);
+    }
+}
+
 // nr_free_pages - call pmm->nr_free_pages to get the size (nr*PAGESIZE)
 // of current free memory
 size_t nr_free_pages(void) {
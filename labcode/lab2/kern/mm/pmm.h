@@ -29,6 +29,14 @@ struct pmm_manager {
                                                       // structures(memlayout.h)
     size_t (*nr_free_pages)(void);  // return the number of free pages
     void (*check)(void);            // check the correctness of XXX_pmm_manager
+    size_t (*alloc_pages_bulk)(
+        size_t n,
+        struct Page **array);  // optional: allocate n single pages (not
+                               // contiguous) into array in one pass, return
+                               // the number allocated
+    void (*free_pages_bulk)(struct Page **array,
+                            size_t n);  // optional: free the n single pages
+                                        // in array in one pass
     // only used in slub pmm manager
     // struct kmem_cache *(*kmem_cache_create)(char* name, size_t size);
     // void (*kmem_cache_destroy)(struct kmem_cache *kc);
@@ -43,6 +51,8 @@ void pmm_init(void);
 struct Page *alloc_pages(size_t n);
 void free_pages(struct Page *base, size_t n);
 size_t nr_free_pages(void); // number of free pages
+size_t alloc_pages_bulk(size_t n, struct Page **array);
+void free_pages_bulk(struct Page **array, size_t n);
 
 #define alloc_page() alloc_pages(1)
 #define free_page(page) free_pages(page, 1)
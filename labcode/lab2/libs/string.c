@@ -1,5 +1,6 @@
 #include <string.h>
 #include <riscv.h>
+#include <riscv_string.h>
 
 /* *
  * strlen - calculate the length of the string @s, not including
@@ -10,11 +11,15 @@
  * */
 size_t
 strlen(const char *s) {
+#ifdef __HAVE_ARCH_STRLEN
+    return __strlen(s);
+#else
     size_t cnt = 0;
     while (*s ++ != '\0') {
         cnt ++;
     }
     return cnt;
+#endif /* __HAVE_ARCH_STRLEN */
 }
 
 /* *
@@ -32,11 +37,15 @@ strlen(const char *s) {
  * */
 size_t
 strnlen(const char *s, size_t len) {
+#ifdef __HAVE_ARCH_STRNLEN
+    return __strnlen(s, len);
+#else
     size_t cnt = 0;
     while (cnt < len && *s ++ != '\0') {
         cnt ++;
     }
     return cnt;
+#endif /* __HAVE_ARCH_STRNLEN */
 }
 
 /* *
@@ -125,10 +134,14 @@ strcmp(const char *s1, const char *s2) {
  * */
 int
 strncmp(const char *s1, const char *s2, size_t n) {
+#ifdef __HAVE_ARCH_STRNCMP
+    return __strncmp(s1, s2, n);
+#else
     while (n > 0 && *s1 != '\0' && *s1 == *s2) {
         n --, s1 ++, s2 ++;
     }
     return (n == 0) ? 0 : (int)((unsigned char)*s1 - (unsigned char)*s2);
+#endif /* __HAVE_ARCH_STRNCMP */
 }
 
 /* *
@@ -141,6 +154,9 @@ strncmp(const char *s1, const char *s2, size_t n) {
  * */
 char *
 strchr(const char *s, char c) {
+#ifdef __HAVE_ARCH_STRCHR
+    return __strchr(s, c);
+#else
     while (*s != '\0') {
         if (*s == c) {
             return (char *)s;
@@ -148,6 +164,7 @@ strchr(const char *s, char c) {
         s ++;
     }
     return NULL;
+#endif /* __HAVE_ARCH_STRCHR */
 }
 
 /* *
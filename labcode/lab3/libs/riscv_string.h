@@ -0,0 +1,245 @@
+#ifndef __LIBS_RISCV_STRING_H__
+#define __LIBS_RISCV_STRING_H__
+
+#include <defs.h>
+
+/* *
+ * Word-wide memset/memcpy/memmove and string routines for RV64, picked up
+ * by libs/string.c through the __HAVE_ARCH_* hooks.
+ *
+ * The bulk of the work is done with aligned 64-bit loads and stores, eight
+ * per loop iteration, with byte loops for the unaligned head and the tail.
+ * Misaligned 64-bit accesses trap into the SBI on most cores, so memcpy and
+ * memmove only go word-wide when @dst and @src are aligned alike; anything
+ * else is copied one byte at a time as before.
+ * */
+
+// a word may alias whatever the caller stored in the buffer
+typedef uint64_t __attribute__((__may_alias__)) __word_t;
+
+#define __WORD_SIZE         sizeof(__word_t)
+#define __WORD_MASK         (__WORD_SIZE - 1)
+
+#define __HAVE_ARCH_MEMSET
+static inline void *
+__memset(void *s, char c, size_t n) {
+    uint8_t *p = s;
+    __word_t w = (uint8_t)c * 0x0101010101010101ULL;
+    while (n > 0 && ((uintptr_t)p & __WORD_MASK) != 0) {
+        *p ++ = c, n --;
+    }
+    __word_t *q = (__word_t *)p;
+    for (; n >= 8 * __WORD_SIZE; n -= 8 * __WORD_SIZE, q += 8) {
+        q[0] = w, q[1] = w, q[2] = w, q[3] = w;
+        q[4] = w, q[5] = w, q[6] = w, q[7] = w;
+    }
+    for (; n >= __WORD_SIZE; n -= __WORD_SIZE) {
+        *q ++ = w;
+    }
+    p = (uint8_t *)q;
+    while (n -- > 0) {
+        *p ++ = c;
+    }
+    return s;
+}
+
+#define __HAVE_ARCH_MEMCPY
+static inline void *
+__memcpy(void *dst, const void *src, size_t n) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    if ((((uintptr_t)d ^ (uintptr_t)s) & __WORD_MASK) == 0) {
+        while (n > 0 && ((uintptr_t)d & __WORD_MASK) != 0) {
+            *d ++ = *s ++, n --;
+        }
+        __word_t *dq = (__word_t *)d;
+        const __word_t *sq = (const __word_t *)s;
+        for (; n >= 8 * __WORD_SIZE; n -= 8 * __WORD_SIZE, dq += 8, sq += 8) {
+            __word_t t0 = sq[0], t1 = sq[1], t2 = sq[2], t3 = sq[3];
+            __word_t t4 = sq[4], t5 = sq[5], t6 = sq[6], t7 = sq[7];
+            dq[0] = t0, dq[1] = t1, dq[2] = t2, dq[3] = t3;
+            dq[4] = t4, dq[5] = t5, dq[6] = t6, dq[7] = t7;
+        }
+        for (; n >= __WORD_SIZE; n -= __WORD_SIZE) {
+            *dq ++ = *sq ++;
+        }
+        d = (uint8_t *)dq, s = (const uint8_t *)sq;
+    }
+    while (n -- > 0) {
+        *d ++ = *s ++;
+    }
+    return dst;
+}
+
+#define __HAVE_ARCH_MEMMOVE
+static inline void *
+__memmove(void *dst, const void *src, size_t n) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    if (!(s < d && s + n > d)) {
+        // a forward copy never overwrites source bytes it has yet to read
+        return __memcpy(dst, src, n);
+    }
+    d += n, s += n;
+    if ((((uintptr_t)d ^ (uintptr_t)s) & __WORD_MASK) == 0) {
+        while (n > 0 && ((uintptr_t)d & __WORD_MASK) != 0) {
+            *-- d = *-- s, n --;
+        }
+        __word_t *dq = (__word_t *)d;
+        const __word_t *sq = (const __word_t *)s;
+        for (; n >= 8 * __WORD_SIZE; n -= 8 * __WORD_SIZE) {
+            dq -= 8, sq -= 8;
+            __word_t t0 = sq[0], t1 = sq[1], t2 = sq[2], t3 = sq[3];
+            __word_t t4 = sq[4], t5 = sq[5], t6 = sq[6], t7 = sq[7];
+            dq[7] = t7, dq[6] = t6, dq[5] = t5, dq[4] = t4;
+            dq[3] = t3, dq[2] = t2, dq[1] = t1, dq[0] = t0;
+        }
+        for (; n >= __WORD_SIZE; n -= __WORD_SIZE) {
+            *-- dq = *-- sq;
+        }
+        d = (uint8_t *)dq, s = (const uint8_t *)sq;
+    }
+    while (n -- > 0) {
+        *-- d = *-- s;
+    }
+    return dst;
+}
+
+/* *
+ * Word-at-a-time string routines. A word has a NUL byte iff __has_zero()
+ * is nonzero. The lowest flagged byte is always a real NUL, but only the
+ * presence test is used here: the word loops skip over words that are
+ * proven NUL-free (and equal), then a byte loop finds the exact position.
+ *
+ * All word loads are aligned, so they never cross into the next page. The
+ * bytes read before the start of the string (in the first word) or after its
+ * terminator (in the last) are on a page the string itself is on, and are
+ * masked or ignored. Strings ending on the last byte of a mapped page are
+ * therefore safe.
+ * */
+#define __ONES              ((__word_t)0x0101010101010101ULL)
+#define __HIGHS             ((__word_t)0x8080808080808080ULL)
+#define __has_zero(w)       (((w) - __ONES) & ~(w) & __HIGHS)
+// the @off low bytes of an aligned word, i.e. those before a string at offset @off
+#define __low_bytes(off)    (((__word_t)1 << (8 * (off))) - 1)
+
+#define __HAVE_ARCH_STRLEN
+static inline size_t
+__strlen(const char *s) {
+    size_t off = (uintptr_t)s & __WORD_MASK;
+    const __word_t *w = (const __word_t *)(s - off);
+    __word_t v = *w | __low_bytes(off);
+    while (!__has_zero(v)) {
+        v = *++ w;
+    }
+    const char *p = ((const char *)w < s) ? s : (const char *)w;
+    while (*p != '\0') {
+        p ++;
+    }
+    return p - s;
+}
+
+#define __HAVE_ARCH_STRNLEN
+static inline size_t
+__strnlen(const char *s, size_t len) {
+    size_t off = (uintptr_t)s & __WORD_MASK, cnt;
+    const __word_t *w = (const __word_t *)(s - off);
+    if (len == 0) {
+        return 0;
+    }
+    // cnt counts the bytes of @s covered by the words loaded so far
+    __word_t v = *w | __low_bytes(off);
+    for (cnt = __WORD_SIZE - off; !__has_zero(v) && cnt < len; cnt += __WORD_SIZE) {
+        v = *++ w;
+    }
+    cnt = ((const char *)w < s) ? 0 : (const char *)w - s;
+    while (cnt < len && s[cnt] != '\0') {
+        cnt ++;
+    }
+    return cnt;
+}
+
+/* *
+ * __strncmp_words - skip the leading words of @s1 and @s2 that are equal and
+ * NUL-free, at most @n bytes. @s1 must be aligned. If @s2 is not, its words
+ * are put together from two aligned loads, and the second one is only done
+ * once the rest of the first is known to hold no NUL.
+ * return value: the number of bytes skipped, a multiple of the word size
+ * */
+static inline size_t
+__strncmp_words(const char *s1, const char *s2, size_t n) {
+    const __word_t *w1 = (const __word_t *)s1;
+    size_t off = (uintptr_t)s2 & __WORD_MASK;
+    if (off == 0) {
+        const __word_t *w2 = (const __word_t *)s2;
+        for (; n >= __WORD_SIZE && *w1 == *w2 && !__has_zero(*w1); n -= __WORD_SIZE) {
+            w1 ++, w2 ++;
+        }
+    } else {
+        const __word_t *w2 = (const __word_t *)(s2 - off);
+        __word_t lo = *w2, hi;
+        for (; n >= __WORD_SIZE && !__has_zero(lo | __low_bytes(off)); n -= __WORD_SIZE) {
+            hi = *++ w2;
+            if (*w1 != ((lo >> (8 * off)) | (hi << (64 - 8 * off))) || __has_zero(*w1)) {
+                break;
+            }
+            w1 ++, lo = hi;
+        }
+    }
+    return (const char *)w1 - s1;
+}
+
+#define __HAVE_ARCH_STRCMP
+static inline int
+__strcmp(const char *s1, const char *s2) {
+    while (((uintptr_t)s1 & __WORD_MASK) != 0 && *s1 != '\0' && *s1 == *s2) {
+        s1 ++, s2 ++;
+    }
+    if (((uintptr_t)s1 & __WORD_MASK) == 0) {
+        size_t skip = __strncmp_words(s1, s2, (size_t)-1);
+        s1 += skip, s2 += skip;
+    }
+    while (*s1 != '\0' && *s1 == *s2) {
+        s1 ++, s2 ++;
+    }
+    return (int)((unsigned char)*s1 - (unsigned char)*s2);
+}
+
+#define __HAVE_ARCH_STRNCMP
+static inline int
+__strncmp(const char *s1, const char *s2, size_t n) {
+    while (n > 0 && ((uintptr_t)s1 & __WORD_MASK) != 0 && *s1 != '\0' && *s1 == *s2) {
+        n --, s1 ++, s2 ++;
+    }
+    if (n > 0 && ((uintptr_t)s1 & __WORD_MASK) == 0) {
+        size_t skip = __strncmp_words(s1, s2, n);
+        n -= skip, s1 += skip, s2 += skip;
+    }
+    while (n > 0 && *s1 != '\0' && *s1 == *s2) {
+        n --, s1 ++, s2 ++;
+    }
+    return (n == 0) ? 0 : (int)((unsigned char)*s1 - (unsigned char)*s2);
+}
+
+#define __HAVE_ARCH_STRCHR
+static inline char *
+__strchr(const char *s, char c) {
+    size_t off = (uintptr_t)s & __WORD_MASK;
+    const __word_t *w = (const __word_t *)(s - off);
+    __word_t cc = (uint8_t)c * __ONES, v = *w;
+    // stop at the first word holding the terminator or @c
+    if (!__has_zero(v | __low_bytes(off)) && !__has_zero((v ^ cc) | __low_bytes(off))) {
+        do {
+            v = *++ w;
+        } while (!__has_zero(v) && !__has_zero(v ^ cc));
+    }
+    const char *p = ((const char *)w < s) ? s : (const char *)w;
+    for (; *p != '\0'; p ++) {
+        if (*p == c) {
+            return (char *)p;
+        }
+    }
+    return NULL;
+}
+
+#endif /* !__LIBS_RISCV_STRING_H__ */
@@ -31,21 +31,96 @@ static uint32_t fdt32_to_cpu(uint32_t x) {
            (((x >> 16) & 0xff) << 8) | ((x >> 24) & 0xff);
 }
 
-static uint64_t fdt64_to_cpu(uint64_t x) {
-    return ((uint64_t)fdt32_to_cpu(x & 0xffffffff) << 32) | 
-           fdt32_to_cpu(x >> 32);
+// 读取 @cells 个 32 位大端 cell 组成的数（#address-cells / #size-cells 最多为 2）
+static uint64_t fdt_read_cells(const uint32_t *p, uint32_t cells) {
+    uint64_t val = 0;
+    for (uint32_t i = 0; i < cells; i++) {
+        val = (val << 32) | fdt32_to_cpu(p[i]);
+    }
+    return val;
+}
+
+// 解析出的内存区域表：memory 节点中的可用内存，以及需要保留的内存
+static struct dtb_mem_region memory_regions[DTB_MAX_REGIONS];
+static struct dtb_mem_region reserved_regions[DTB_MAX_REGIONS];
+static int nr_memory_regions = 0;
+static int nr_reserved_regions = 0;
+// 启动 hart 所在的 NUMA 节点，以及 distance-map 给出的节点间距离（0 表示未给出）
+static int boot_cpu_nid = 0;
+static uint32_t numa_distance[MAX_NUMNODES][MAX_NUMNODES];
+// 启动 hart 的 riscv,isa 字符串和 riscv,isa-extensions 列表（以 '\0' 分隔）
+#define ISA_STRING_MAX      512
+static char isa_string[ISA_STRING_MAX];
+static char isa_extensions[ISA_STRING_MAX];
+static uint32_t isa_extensions_len = 0;
+
+// 按基址有序插入区域表，表满时丢弃并告警
+static void region_add(struct dtb_mem_region *table, int *nr,
+                       uint64_t base, uint64_t size, int nid, const char *what) {
+    if (size == 0) {
+        return;
+    }
+    if (*nr >= DTB_MAX_REGIONS) {
+        cprintf("Warning: too many %s regions, dropping [0x%016lx, 0x%016lx)\n",
+                what, base, base + size);
+        return;
+    }
+    int i = *nr;
+    while (i > 0 && table[i - 1].base > base) {
+        table[i] = table[i - 1];
+        i--;
+    }
+    table[i].base = base;
+    table[i].size = size;
+    table[i].nid = nid;
+    (*nr)++;
+}
+
+// 节点类型：memory 节点、/reserved-memory 容器及其子节点
+#define NODE_OTHER          0
+#define NODE_MEMORY         1
+#define NODE_RSV_CONTAINER  2
+#define NODE_RSV_CHILD      3
+#define NODE_CPUS           4
+#define NODE_CPU            5
+#define NODE_DISTANCE_MAP   6
+
+#define FDT_MAX_DEPTH       16
+
+// 节点名是否为 @base（允许带 "@unit-address" 后缀）
+static int node_name_is(const char *name, const char *base) {
+    size_t len = strlen(base);
+    return strncmp(name, base, len) == 0 && (name[len] == '\0' || name[len] == '@');
 }
 
-// 简化的内存信息提取函数
-static int extract_memory_info(uintptr_t dtb_vaddr, const struct fdt_header *header, 
-                              uint64_t *mem_base, uint64_t *mem_size) {
+// 超出 MAX_NUMNODES 的 numa-node-id 归到节点 0
+static int fdt_nid(uint32_t nid) {
+    if (nid >= MAX_NUMNODES) {
+        cprintf("Warning: numa-node-id %d out of range, using node 0\n", nid);
+        return 0;
+    }
+    return nid;
+}
+
+// 遍历整个结构块：收集所有 memory 节点的每个 reg 条目（及其 numa-node-id），
+// /reserved-memory 子节点的 reg，启动 hart 的 numa-node-id 和 distance-map。reg 的格式由父节点的 #address-cells /
+// #size-cells 决定，属性顺序不定，所以 reg 先记下来，到 END_NODE 时再解析。
+static int extract_memory_info(uintptr_t dtb_vaddr, const struct fdt_header *header) {
     uint32_t struct_offset = fdt32_to_cpu(header->off_dt_struct);
     uint32_t strings_offset = fdt32_to_cpu(header->off_dt_strings);
     
     const char *strings_base = (const char *)(dtb_vaddr + strings_offset);
     const uint32_t *struct_ptr = (const uint32_t *)(dtb_vaddr + struct_offset);
     
-    int in_memory_node = 0;
+    // 第 d 层节点声明的 cells（作用于它的子节点）、节点类型和 reg 属性
+    uint32_t addr_cells[FDT_MAX_DEPTH], size_cells[FDT_MAX_DEPTH];
+    int kind[FDT_MAX_DEPTH];
+    const uint32_t *reg[FDT_MAX_DEPTH];
+    uint32_t reg_len[FDT_MAX_DEPTH];
+    int nid[FDT_MAX_DEPTH];
+    const char *isa = NULL, *isa_exts = NULL;
+    uint32_t isa_exts_len = 0;
+    int depth = -1;
     
     while (1) {
         uint32_t token = fdt32_to_cpu(*struct_ptr++);
@@ -55,9 +130,27 @@ static int extract_memory_info(uintptr_t dtb_vaddr, const struct fdt_header *hea
                 const char *name = (const char *)struct_ptr;
                 int name_len = strlen(name);
                 
-                // 检查是否是memory节点
-                if (strncmp(name, "memory", 6) == 0) {
-                    in_memory_node = 1;
+                if (++depth >= FDT_MAX_DEPTH) {
+                    return -1; // 嵌套过深
+                }
+                addr_cells[depth] = 2;
+                size_cells[depth] = 1;
+                reg[depth] = NULL;
+                reg_len[depth] = 0;
+                nid[depth] = 0;
+                kind[depth] = NODE_OTHER;
+                if (depth == 1 && node_name_is(name, "memory")) {
+                    kind[depth] = NODE_MEMORY;
+                } else if (depth == 1 && node_name_is(name, "reserved-memory")) {
+                    kind[depth] = NODE_RSV_CONTAINER;
+                } else if (depth == 1 && node_name_is(name, "cpus")) {
+                    kind[depth] = NODE_CPUS;
+                } else if (depth == 1 && node_name_is(name, "distance-map")) {
+                    kind[depth] = NODE_DISTANCE_MAP;
+                } else if (depth == 2 && kind[1] == NODE_RSV_CONTAINER) {
+                    kind[depth] = NODE_RSV_CHILD;
+                } else if (depth == 2 && kind[1] == NODE_CPUS && node_name_is(name, "cpu")) {
+                    kind[depth] = NODE_CPU;
                 }
                 
                 // 跳过节点名（4字节对齐）
@@ -65,22 +158,86 @@ static int extract_memory_info(uintptr_t dtb_vaddr, const struct fdt_header *hea
                 break;
             }
             
-            case FDT_END_NODE:
-                in_memory_node = 0;
+            case FDT_END_NODE: {
+                if (depth <= 0) {
+                    return depth == 0 ? 0 : -1; // 根节点结束
+                }
+                if ((kind[depth] == NODE_MEMORY || kind[depth] == NODE_RSV_CHILD) &&
+                    reg[depth] != NULL) {
+                    uint32_t ac = addr_cells[depth - 1], sc = size_cells[depth - 1];
+                    uint32_t entry = (ac + sc) * sizeof(uint32_t);
+                    if (entry == 0 || ac > 2 || sc > 2) {
+                        return -1;
+                    }
+                    for (uint32_t off = 0; off + entry <= reg_len[depth]; off += entry) {
+                        const uint32_t *cell = reg[depth] + off / sizeof(uint32_t);
+                        uint64_t base = fdt_read_cells(cell, ac);
+                        uint64_t size = fdt_read_cells(cell + ac, sc);
+                        if (kind[depth] == NODE_MEMORY) {
+                            region_add(memory_regions, &nr_memory_regions, base, size,
+                                       nid[depth], "memory");
+                        } else {
+                            region_add(reserved_regions, &nr_reserved_regions, base, size,
+                                       0, "reserved");
+                        }
+                    }
+                }
+                if (kind[depth] == NODE_CPU && reg[depth] != NULL &&
+                    reg_len[depth] >= addr_cells[depth - 1] * sizeof(uint32_t) &&
+                    fdt_read_cells(reg[depth], addr_cells[depth - 1]) == boot_hartid) {
+                    boot_cpu_nid = nid[depth];
+                    if (isa != NULL) {
+                        strncpy(isa_string, isa, ISA_STRING_MAX - 1);
+                    }
+                    if (isa_exts != NULL) {
+                        isa_extensions_len = (isa_exts_len < ISA_STRING_MAX) ? isa_exts_len : ISA_STRING_MAX;
+                        memcpy(isa_extensions, isa_exts, isa_extensions_len);
+                        isa_extensions[ISA_STRING_MAX - 1] = '\0';
+                    }
+                }
+                if (kind[depth] == NODE_CPU) {
+                    isa = isa_exts = NULL;
+                }
+                depth--;
                 break;
+            }
                 
             case FDT_PROP: {
                 uint32_t prop_len = fdt32_to_cpu(*struct_ptr++);
                 uint32_t prop_nameoff = fdt32_to_cpu(*struct_ptr++);
                 const char *prop_name = strings_base + prop_nameoff;
-                const void *prop_data = struct_ptr;
+                const uint32_t *prop_data = struct_ptr;
                 
-                // 在memory节点中查找reg属性
-                if (in_memory_node && strcmp(prop_name, "reg") == 0 && prop_len >= 16) {
-                    const uint64_t *reg_data = (const uint64_t *)prop_data;
-                    *mem_base = fdt64_to_cpu(reg_data[0]);
-                    *mem_size = fdt64_to_cpu(reg_data[1]);
-                    return 0; // 成功找到
+                if (depth >= 0) {
+                    if (strcmp(prop_name, "#address-cells") == 0 && prop_len == 4) {
+                        addr_cells[depth] = fdt32_to_cpu(prop_data[0]);
+                    } else if (strcmp(prop_name, "#size-cells") == 0 && prop_len == 4) {
+                        size_cells[depth] = fdt32_to_cpu(prop_data[0]);
+                    } else if (strcmp(prop_name, "reg") == 0) {
+                        reg[depth] = prop_data;
+                        reg_len[depth] = prop_len;
+                    } else if (kind[depth] == NODE_CPU && strcmp(prop_name, "riscv,isa") == 0) {
+                        isa = (const char *)prop_data;
+                    } else if (kind[depth] == NODE_CPU && strcmp(prop_name, "riscv,isa-extensions") == 0) {
+                        isa_exts = (const char *)prop_data;
+                        isa_exts_len = prop_len;
+                    } else if (strcmp(prop_name, "numa-node-id") == 0 && prop_len == 4) {
+                        nid[depth] = fdt_nid(fdt32_to_cpu(prop_data[0]));
+                    } else if (kind[depth] == NODE_DISTANCE_MAP &&
+                               strcmp(prop_name, "distance-matrix") == 0) {
+                        // <from to distance> 三元组
+                        for (uint32_t i = 0; i + 3 <= prop_len / sizeof(uint32_t); i += 3) {
+                            uint32_t from = fdt32_to_cpu(prop_data[i]);
+                            uint32_t to = fdt32_to_cpu(prop_data[i + 1]);
+                            if (from < MAX_NUMNODES && to < MAX_NUMNODES) {
+                                numa_distance[from][to] = fdt32_to_cpu(prop_data[i + 2]);
+                            }
+                        }
+                    } else if (depth == 1 && prop_len > 0 &&
+                               strcmp(prop_name, "device_type") == 0 &&
+                               strcmp((const char *)prop_data, "memory") == 0) {
+                        kind[depth] = NODE_MEMORY;
+                    }
                 }
                 
                 // 跳过属性数据（4字节对齐）
@@ -92,7 +249,7 @@ static int extract_memory_info(uintptr_t dtb_vaddr, const struct fdt_header *hea
                 break;
                 
             case FDT_END:
-                return -1; // 没有找到
+                return 0;
                 
             default:
                 return -1; // 错误
@@ -100,9 +257,18 @@ static int extract_memory_info(uintptr_t dtb_vaddr, const struct fdt_header *hea
     }
 }
 
-// 保存解析出的系统物理内存信息
-static uint64_t memory_base = 0;
-static uint64_t memory_size = 0;
+// 内存保留映射（mem_rsvmap）：以 {0, 0} 结尾的 64 位大端 (address, size) 数组
+static void extract_rsvmap(uintptr_t dtb_vaddr, const struct fdt_header *header) {
+    const uint32_t *entry = (const uint32_t *)(dtb_vaddr + fdt32_to_cpu(header->off_mem_rsvmap));
+    for (;; entry += 4) {
+        uint64_t base = fdt_read_cells(entry, 2);
+        uint64_t size = fdt_read_cells(entry + 2, 2);
+        if (base == 0 && size == 0) {
+            break;
+        }
+        region_add(reserved_regions, &nr_reserved_regions, base, size, 0, "reserved");
+    }
+}
 
 void dtb_init(void) {
     cprintf("DTB Init\n");
@@ -125,26 +291,116 @@ void dtb_init(void) {
         return;
     }
     
-    // 提取内存信息
-    uint64_t mem_base, mem_size;
-    if (extract_memory_info(dtb_vaddr, header, &mem_base, &mem_size) == 0) {
+    // 提取内存信息；DTB 本身也要保留，避免被分配器覆盖
+    extract_rsvmap(dtb_vaddr, header);
+    region_add(reserved_regions, &nr_reserved_regions, boot_dtb,
+               fdt32_to_cpu(header->totalsize), 0, "reserved");
+    if (extract_memory_info(dtb_vaddr, header) != 0) {
+        cprintf("Warning: malformed DTB structure block\n");
+    }
+    if (isa_string[0] != '\0') {
+        cprintf("ISA: %s\n", isa_string);
+    }
+    if (nr_memory_regions > 0) {
         cprintf("Physical Memory from DTB:\n");
-        cprintf("  Base: 0x%016lx\n", mem_base);
-        cprintf("  Size: 0x%016lx (%ld MB)\n", mem_size, mem_size / (1024 * 1024));
-        cprintf("  End:  0x%016lx\n", mem_base + mem_size - 1);
-        // 保存到全局变量，供 PMM 查询
-        memory_base = mem_base;
-        memory_size = mem_size;
+        for (int i = 0; i < nr_memory_regions; i++) {
+            uint64_t base = memory_regions[i].base, size = memory_regions[i].size;
+            cprintf("  Bank %d: [0x%016lx, 0x%016lx] (%ld MB), node %d\n", i, base,
+                    base + size - 1, size / (1024 * 1024), memory_regions[i].nid);
+        }
+        for (int i = 0; i < nr_reserved_regions; i++) {
+            uint64_t base = reserved_regions[i].base, size = reserved_regions[i].size;
+            cprintf("  Reserved: [0x%016lx, 0x%016lx]\n", base, base + size - 1);
+        }
     } else {
         cprintf("Warning: Could not extract memory info from DTB\n");
     }
     cprintf("DTB init completed\n");
 }
 
+/* *
+ * dtb_memory_regions - all memory banks from the DTB, sorted by base
+ * */
+int dtb_memory_regions(const struct dtb_mem_region **regions) {
+    *regions = memory_regions;
+    return nr_memory_regions;
+}
+
+/* *
+ * dtb_reserved_regions - /reserved-memory, mem_rsvmap and the DTB blob
+ * itself, sorted by base; they may overlap each other
+ * */
+int dtb_reserved_regions(const struct dtb_mem_region **regions) {
+    *regions = reserved_regions;
+    return nr_reserved_regions;
+}
+
+/* *
+ * dtb_boot_cpu_node - numa-node-id of the boot hart, 0 if not given
+ * */
+int dtb_boot_cpu_node(void) {
+    return boot_cpu_nid;
+}
+
+/* *
+ * dtb_numa_distance - distance between two nodes from /distance-map,
+ * 10 to itself and 20 to any other node if the map does not say
+ * */
+int dtb_numa_distance(int from, int to) {
+    if (numa_distance[from][to] != 0) {
+        return numa_distance[from][to];
+    }
+    return (from == to) ? 10 : 20;
+}
+
+/* *
+ * dtb_isa_has - whether the boot hart implements ISA extension @ext, going by
+ * riscv,isa-extensions if the DTB has it and riscv,isa otherwise. @ext is a
+ * lower-case name, a single letter ("v") or a multi-letter one ("svinval").
+ * */
+int dtb_isa_has(const char *ext) {
+    size_t len = strlen(ext);
+    const char *p;
+    for (p = isa_extensions; p < isa_extensions + isa_extensions_len; p += strlen(p) + 1) {
+        if (strcmp(p, ext) == 0) {
+            return 1;
+        }
+    }
+    // "rv64" 之后是单字母扩展（g 即 imafd），再之后是以 '_' 分隔的多字母扩展
+    if (strncmp(isa_string, "rv", 2) != 0) {
+        return 0;
+    }
+    for (p = isa_string + 2; *p >= '0' && *p <= '9'; p ++)
+        ;
+    for (; *p != '\0' && *p != '_' && *p != 'z' && *p != 's' && *p != 'x'; p ++) {
+        if (len == 1 && (*p == ext[0] || (*p == 'g' && strchr("imafd", ext[0]) != NULL))) {
+            return 1;
+        }
+    }
+    while (len > 1 && *p != '\0') {
+        if (*p == '_') {
+            p ++;
+            continue;
+        }
+        const char *end = strfind(p, '_');
+        if (end - p == len && strncmp(p, ext, len) == 0) {
+            return 1;
+        }
+        p = end;
+    }
+    return 0;
+}
+
+// 最低的内存基址
 uint64_t get_memory_base(void) {
-    return memory_base;
+    return nr_memory_regions > 0 ? memory_regions[0].base : 0;
 }
 
+// 所有内存 bank 的总大小（bank 之间可能有空洞）
 uint64_t get_memory_size(void) {
-    return memory_size;
-}
\ No newline at end of file
+    uint64_t size = 0;
+    for (int i = 0; i < nr_memory_regions; i++) {
+        size += memory_regions[i].size;
+    }
+    return size;
+}
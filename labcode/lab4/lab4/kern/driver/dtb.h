@@ -7,7 +7,20 @@
 extern uint64_t boot_hartid;
 extern uint64_t boot_dtb;
 
+#define DTB_MAX_REGIONS     32
+
+struct dtb_mem_region {
+    uint64_t base;
+    uint64_t size;
+    int nid;                // numa-node-id of the memory node, 0 if absent
+};
+
 void dtb_init(void);
+int dtb_memory_regions(const struct dtb_mem_region **regions);
+int dtb_reserved_regions(const struct dtb_mem_region **regions);
+int dtb_boot_cpu_node(void);
+int dtb_numa_distance(int from, int to);
+int dtb_isa_has(const char *ext);
 uint64_t get_memory_base(void);
 uint64_t get_memory_size(void);
 
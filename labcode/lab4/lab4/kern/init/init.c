@@ -13,10 +13,260 @@
 #include <proc.h>
 #include <kmonitor.h>
 #include <dtb.h>
+#include <riscv.h>
+#include <riscv_string.h>
 
 int kern_init(void) __attribute__((noreturn));
 void grade_backtrace(void);
 
+// vector_init - hand string.h over to the RVV routines if the boot hart has V:
+// the DTB has to list it, and sstatus.VS has to stick (the field is WARL and
+// reads back 0 on a hart without V)
+static void
+vector_init(void) {
+    char a[256], b[256];
+    if (!dtb_isa_has("v")) {
+        cprintf("vector: no V extension, scalar string routines\n");
+        return;
+    }
+    set_csr(sstatus, SSTATUS_VS_INITIAL);
+    bool present = (read_csr(sstatus) & SSTATUS_VS) != 0;
+    clear_csr(sstatus, SSTATUS_VS);
+    if (!present) {
+        cprintf("vector: sstatus.VS is hardwired to 0, scalar string routines\n");
+        return;
+    }
+
+    __rvv_enabled = 1;
+    memset(a, 'x', sizeof(a) - 1);
+    a[sizeof(a) - 1] = '\0';
+    memcpy(b, a, sizeof(a));
+    assert(strlen(a) == sizeof(a) - 1 && strcmp(a, b) == 0);
+    assert(memcmp(a, b, sizeof(a)) == 0);
+    b[200] = 'y';
+    assert(strcmp(a, b) < 0 && memcmp(b, a, sizeof(a)) > 0);
+    assert((read_csr(sstatus) & SSTATUS_VS) == 0);
+    cprintf("vector: using RVV string routines\n");
+}
+
+// the byte loops libs/string.c used before the word-wide versions; loop
+// distribution is off so gcc does not turn them back into library calls
+#define BYTE_LOOP __attribute__((noinline, optimize("no-tree-loop-distribute-patterns")))
+
+static BYTE_LOOP size_t
+byte_strlen(const char *s) {
+    size_t cnt = 0;
+    while (*s ++ != '\0') {
+        cnt ++;
+    }
+    return cnt;
+}
+
+static BYTE_LOOP size_t
+byte_strnlen(const char *s, size_t len) {
+    size_t cnt = 0;
+    while (cnt < len && *s ++ != '\0') {
+        cnt ++;
+    }
+    return cnt;
+}
+
+static BYTE_LOOP int
+byte_strcmp(const char *s1, const char *s2) {
+    while (*s1 != '\0' && *s1 == *s2) {
+        s1 ++, s2 ++;
+    }
+    return (int)((unsigned char)*s1 - (unsigned char)*s2);
+}
+
+static BYTE_LOOP int
+byte_strncmp(const char *s1, const char *s2, size_t n) {
+    while (n > 0 && *s1 != '\0' && *s1 == *s2) {
+        n --, s1 ++, s2 ++;
+    }
+    return (n == 0) ? 0 : (int)((unsigned char)*s1 - (unsigned char)*s2);
+}
+
+static BYTE_LOOP char *
+byte_strchr(const char *s, char c) {
+    while (*s != '\0') {
+        if (*s == c) {
+            return (char *)s;
+        }
+        s ++;
+    }
+    return NULL;
+}
+
+// long enough for a head, two whole words and a tail at every alignment
+#define CHECK_STR_MAX       (2 * __WORD_SIZE + 3)
+
+// check_str_place - put a string of @len bytes at offset @align into the word
+// grid of @page, at its start or with the terminator in the last word of the page
+static char *
+check_str_place(char *page, size_t align, size_t len, bool at_end) {
+    char *s = page + align;
+    if (at_end) {
+        s = page + PGSIZE - 1 - len;
+        s -= ((uintptr_t)s - align) & __WORD_MASK;
+    }
+    for (size_t i = 0; i < len; i ++) {
+        s[i] = 0x7e + i % 5;
+    }
+    s[len] = '\0';
+    return s;
+}
+
+// check_string_routines - compare string.h with the byte loops for every
+// alignment of each string, every length up to CHECK_STR_MAX and every position
+// of the searched char or of the first difference
+static void
+check_string_routines(char *p1, char *p2) {
+    for (int at_end = 0; at_end <= 1; at_end ++) {
+        for (size_t a1 = 0; a1 < __WORD_SIZE; a1 ++) {
+            for (size_t len = 0; len <= CHECK_STR_MAX; len ++) {
+                char *s = check_str_place(p1, a1, len, at_end);
+                assert(strlen(s) == byte_strlen(s));
+                for (size_t n = 0; n <= len + 1; n ++) {
+                    assert(strnlen(s, n) == byte_strnlen(s, n));
+                }
+                for (size_t pos = 0; pos <= len; pos ++) {
+                    assert(strchr(s, s[pos]) == byte_strchr(s, s[pos]));
+                }
+                assert(strchr(s, 'z') == NULL);
+
+                for (size_t a2 = 0; a2 < __WORD_SIZE; a2 ++) {
+                    for (size_t diff = 0; diff <= len; diff ++) {
+                        char *s1 = check_str_place(p1, a1, len, at_end);
+                        char *s2 = check_str_place(p2, a2, len, at_end);
+                        // diff == len leaves them equal; 0x80 flips the sign of a char
+                        s2[diff] ^= (diff < len) ? 0x80 : 0;
+                        assert(strcmp(s1, s2) == byte_strcmp(s1, s2));
+                        assert(strcmp(s2, s1) == byte_strcmp(s2, s1));
+                        for (size_t n = 0; n <= len + 1; n ++) {
+                            assert(strncmp(s1, s2, n) == byte_strncmp(s1, s2, n));
+                            assert(strncmp(s2, s1, n) == byte_strncmp(s2, s1, n));
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// the two string pages are mapped here in boot_pgdir, each followed by an
+// unmapped page: a routine that reads past the terminator of a string at the
+// end of its page faults instead of reading the neighbour
+#define CHECK_STR_VA        (4 * PGSIZE)
+
+// check_string - the word-at-a-time routines must agree with the byte loops,
+// and so must the RVV ones when they are in use
+static void
+check_string(void) {
+    size_t nr_free_store = nr_free_pages();
+    struct Page *page = alloc_pages(2);
+    assert(page != NULL);
+    assert(page_insert(boot_pgdir_va, page, CHECK_STR_VA, PTE_W | PTE_R) == 0);
+    assert(page_insert(boot_pgdir_va, page + 1, CHECK_STR_VA + 2 * PGSIZE, PTE_W | PTE_R) == 0);
+    assert(get_page(boot_pgdir_va, CHECK_STR_VA + PGSIZE, NULL) == NULL);
+    assert(get_page(boot_pgdir_va, CHECK_STR_VA + 3 * PGSIZE, NULL) == NULL);
+    char *p1 = (char *)CHECK_STR_VA, *p2 = p1 + 2 * PGSIZE;
+    bool rvv = __rvv_enabled;
+
+    __rvv_enabled = 0;
+    check_string_routines(p1, p2);
+    if ((__rvv_enabled = rvv)) {
+        check_string_routines(p1, p2);
+    }
+    // unmapping frees both pages and the page tables above them
+    page_remove(boot_pgdir_va, CHECK_STR_VA);
+    page_remove(boot_pgdir_va, CHECK_STR_VA + 2 * PGSIZE);
+    assert(nr_free_pages() == nr_free_store);
+    cprintf("check_string() succeeded!\n");
+}
+
+#ifdef STRING_BENCH
+#define BENCH_BUF_PAGES     4
+#define BENCH_BYTES         (1 << 20)   // bytes moved per measurement
+
+static BYTE_LOOP void *
+byte_memset(void *s, char c, size_t n) {
+    char *p = s;
+    while (n -- > 0) {
+        *p ++ = c;
+    }
+    return s;
+}
+
+static BYTE_LOOP void *
+byte_memcpy(void *dst, const void *src, size_t n) {
+    const char *s = src;
+    char *d = dst;
+    while (n -- > 0) {
+        *d ++ = *s ++;
+    }
+    return dst;
+}
+
+static BYTE_LOOP void *
+byte_memmove(void *dst, const void *src, size_t n) {
+    const char *s = src;
+    char *d = dst;
+    if (s < d && s + n > d) {
+        s += n, d += n;
+        while (n -- > 0) {
+            *-- d = *-- s;
+        }
+    } else {
+        while (n -- > 0) {
+            *d ++ = *s ++;
+        }
+    }
+    return dst;
+}
+
+// string_bench - compare the throughput of memset/memcpy/memmove with the old
+// byte loops over a range of sizes, aligned and with a misaligned source.
+// Build with DEFS=-DSTRING_BENCH to enable.
+static void
+string_bench(void) {
+    static const size_t sizes[] = {16, 256, 4096, 16384};
+    struct Page *page = alloc_pages(2 * BENCH_BUF_PAGES);
+    assert(page != NULL);
+    char *dst = page2kva(page), *src = dst + BENCH_BUF_PAGES * PGSIZE;
+
+    cprintf("string_bench: ticks per %d KiB, byte loop / word-wide\n", BENCH_BYTES >> 10);
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i ++) {
+        for (int misalign = 0; misalign <= 1; misalign ++) {
+            size_t n = sizes[i], rounds = BENCH_BYTES / n;
+            const char *s = src + misalign;
+            uint64_t t[6], start;
+            int r;
+
+            start = rdtime();
+            for (r = 0; r < rounds; r ++) byte_memset(dst, r, n);
+            t[0] = rdtime() - start, start = rdtime();
+            for (r = 0; r < rounds; r ++) memset(dst, r, n);
+            t[1] = rdtime() - start, start = rdtime();
+            for (r = 0; r < rounds; r ++) byte_memcpy(dst, s, n);
+            t[2] = rdtime() - start, start = rdtime();
+            for (r = 0; r < rounds; r ++) memcpy(dst, s, n);
+            t[3] = rdtime() - start, start = rdtime();
+            // overlapping, so memmove has to copy backwards
+            for (r = 0; r < rounds; r ++) byte_memmove(dst + 64, dst + misalign, n);
+            t[4] = rdtime() - start, start = rdtime();
+            for (r = 0; r < rounds; r ++) memmove(dst + 64, dst + misalign, n);
+            t[5] = rdtime() - start;
+
+            cprintf("  %5d B%s  memset %6d / %6d  memcpy %6d / %6d  memmove %6d / %6d\n",
+                    n, misalign ? " +1" : "   ", (int)t[0], (int)t[1], (int)t[2],
+                    (int)t[3], (int)t[4], (int)t[5]);
+        }
+    }
+    free_pages(page, 2 * BENCH_BUF_PAGES);
+}
+#endif /* STRING_BENCH */
+
 int kern_init(void)
 {
     extern char edata[], end[];
@@ -28,10 +278,15 @@ int kern_init(void)
     cprintf("%s\n\n", message);
 
     print_kerninfo();
+    vector_init();
 
     // grade_backtrace();
 
     pmm_init(); // init physical memory management
+    check_string();
+#ifdef STRING_BENCH
+    string_bench();
+#endif
 
     pic_init(); // init interrupt controller
     idt_init(); // init interrupt descriptor table
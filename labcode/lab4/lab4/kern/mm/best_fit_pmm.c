@@ -56,14 +56,69 @@
  *               (5.2) reset the fields of pages, such as p->ref, p->flags (PageProperty)
  *               (5.3) try to merge low addr or high addr blocks. Notice: should change some pages's p->property correctly.
  */
+/*
+ * Free blocks are indexed twice so that neither path scans the free list:
+ *   size_tree: ordered by (property, address). The best fit for n pages is the
+ *              leftmost block with property >= n, found in one O(log n) descent;
+ *              ties go to the lowest address, same as the old list scan.
+ *   addr_tree: ordered by address. free_pages looks up the neighbouring free
+ *              blocks here for coalescing, and the predecessor tells where the
+ *              block goes in the address ordered free_list.
+ * free_list is still kept in address order, it is only walked by the checks.
+ */
 static free_area_t free_area;
+static rb_root_t size_tree;
+static rb_root_t addr_tree;
 
 #define free_list (free_area.free_list)
 #define nr_free (free_area.nr_free)
 
+#define size2page(node) rb_entry((node), struct Page, size_node)
+#define addr2page(node) rb_entry((node), struct Page, addr_node)
+
+static void
+size_tree_insert(struct Page *base) {
+    rb_node_t **link = &size_tree.node, *parent = NULL;
+    while (*link != NULL) {
+        struct Page *p = size2page(parent = *link);
+        if (base->property < p->property || (base->property == p->property && base < p)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+    rb_link_node(&(base->size_node), parent, link);
+    rb_insert_color(&(base->size_node), &size_tree);
+}
+
+// addr_tree_insert - link base into addr_tree and into free_list right after
+// its address predecessor
+static void
+addr_tree_insert(struct Page *base) {
+    rb_node_t **link = &addr_tree.node, *parent = NULL;
+    while (*link != NULL) {
+        parent = *link;
+        link = (base < addr2page(parent)) ? &parent->left : &parent->right;
+    }
+    rb_link_node(&(base->addr_node), parent, link);
+    rb_insert_color(&(base->addr_node), &addr_tree);
+
+    rb_node_t *prev = rb_prev(&(base->addr_node));
+    list_add((prev == NULL) ? &free_list : &(addr2page(prev)->page_link), &(base->page_link));
+}
+
+static void
+free_block_remove(struct Page *p) {
+    rb_erase(&(p->size_node), &size_tree);
+    rb_erase(&(p->addr_node), &addr_tree);
+    list_del(&(p->page_link));
+}
+
 static void
 best_fit_init(void) {
     list_init(&free_list);
+    rb_root_init(&size_tree);
+    rb_root_init(&addr_tree);
     nr_free = 0;
 }
 
@@ -81,24 +136,8 @@ best_fit_init_memmap(struct Page *base, size_t n) {
     base->property = n;
     SetPageProperty(base);
     nr_free += n;
-    if (list_empty(&free_list)) {
-        list_add(&free_list, &(base->page_link));
-    } else {
-        list_entry_t* le = &free_list;
-        while ((le = list_next(le)) != &free_list) {
-            struct Page* page = le2page(le, page_link);
-            /*LAB2 EXERCISE 2: 2130984*/ 
-            // 编写代码
-            // 1、当base < page时，找到第一个大于base的页，将base插入到它前面，并退出循环
-            // 2、当list_next(le) == &free_list时，若已经到达链表结尾，将base插入到链表尾部
-            if(base < page) {
-                list_add_before(le, &(base->page_link));
-                break;
-            } else if (list_next(le) == &free_list) {
-                list_add_after(le, &(base->page_link));
-            }
-        }
-    }
+    addr_tree_insert(base);
+    size_tree_insert(base);
 }
 
 static struct Page *
@@ -107,30 +146,27 @@ best_fit_alloc_pages(size_t n) {
     if (n > nr_free) {
         return NULL;
     }
+    // 在size_tree中找property >= n的最左结点，即最小的满足需求的空闲块
     struct Page *page = NULL;
-    list_entry_t *le = &free_list;
-    size_t min_size = nr_free + 1;
-    /*LAB2 EXERCISE 2: 2310984*/ 
-    // 下面的代码是first-fit的部分代码，请修改下面的代码改为best-fit
-    // 遍历空闲链表，查找满足需求的空闲页框
-    // 如果找到满足需求的页面，记录该页面以及当前找到的最小连续空闲页框数量
-
-    while ((le = list_next(le)) != &free_list) {
-        struct Page *p = le2page(le, page_link);
-        if (p->property >= n && p->property < min_size) {
-            page = p, min_size = p->property;
+    rb_node_t *node = size_tree.node;
+    while (node != NULL) {
+        struct Page *p = size2page(node);
+        if (p->property >= n) {
+            page = p;
+            node = node->left;
+        } else {
+            node = node->right;
         }
     }
 
     if (page != NULL) {
-        list_entry_t* prev = list_prev(&(page->page_link));
-        list_del(&(page->page_link));
+        free_block_remove(page);
         if (page->property > n) {
             struct Page *p = page + n;
             p->property = page->property - n;
             SetPageProperty(p);
-
-            list_add(prev, &(p->page_link));
+            addr_tree_insert(p);
+            size_tree_insert(p);
         }
         nr_free -= n;
         ClearPageProperty(page);
@@ -154,49 +190,76 @@ best_fit_free_pages(struct Page *base, size_t n) {
     SetPageProperty(base);
     nr_free += n;
 
+    // 在addr_tree中找到base前后相邻的空闲块
+    struct Page *prev = NULL, *next = NULL;
+    rb_node_t *node = addr_tree.node;
+    while (node != NULL) {
+        p = addr2page(node);
+        if (p < base) {
+            prev = p;
+            node = node->right;
+        } else {
+            next = p;
+            node = node->left;
+        }
+    }
 
-    if (list_empty(&free_list)) {
-        list_add(&free_list, &(base->page_link));
+    // 前一个空闲块与当前页块连续则并入前一块，它在free_list和addr_tree中的位置不变，
+    // 只是大小变了，需要在size_tree中重新插入
+    if (prev != NULL && prev + prev->property == base) {
+        rb_erase(&(prev->size_node), &size_tree);
+        prev->property += base->property;
+        ClearPageProperty(base);
+        base = prev;
     } else {
-        list_entry_t* le = &free_list;
-        while ((le = list_next(le)) != &free_list) {
-            struct Page* page = le2page(le, page_link);
-            if (base < page) {
-                list_add_before(le, &(base->page_link));
-                break;
-            } else if (list_next(le) == &free_list) {
-                list_add(le, &(base->page_link));
-            }
-        }
+        addr_tree_insert(base);
     }
 
-    list_entry_t* le = list_prev(&(base->page_link));
-    if (le != &free_list) {
-        p = le2page(le, page_link);
-        /*LAB2 EXERCISE 2: 2310984*/ 
-        // 编写代码
-        // 1、判断前面的空闲页块是否与当前页块是连续的，如果是连续的，则将当前页块合并到前面的空闲页块中
-        // 2、首先更新前一个空闲页块的大小，加上当前页块的大小
-        // 3、清除当前页块的属性标记，表示不再是空闲页块
-        // 4、从链表中删除当前页块
-        // 5、将指针指向前一个空闲页块，以便继续检查合并后的连续空闲页块
-        if (p + p->property == base) {
-            p->property += base->property;
-            ClearPageProperty(base);
-            list_del(&(base->page_link));
-            base = p;
-        }
+    if (next != NULL && base + base->property == next) {
+        base->property += next->property;
+        ClearPageProperty(next);
+        free_block_remove(next);
     }
+    size_tree_insert(base);
+}
 
-    le = list_next(&(base->page_link));
-    if (le != &free_list) {
-        p = le2page(le, page_link);
-        if (base + base->property == p) {
-            base->property += p->property;
-            ClearPageProperty(p);
-            list_del(&(p->page_link));
+// best_fit_alloc_pages_bulk - take n single pages in one pass, smallest free
+// blocks first so the big ones stay intact
+static size_t
+best_fit_alloc_pages_bulk(size_t n, struct Page **array) {
+    size_t got = 0;
+    rb_node_t *node;
+    while (got < n && (node = rb_first(&size_tree)) != NULL) {
+        struct Page *page = size2page(node), *p;
+        size_t take = (page->property < n - got) ? page->property : n - got;
+        free_block_remove(page);
+        if (page->property > take) {
+            p = page + take;
+            p->property = page->property - take;
+            SetPageProperty(p);
+            addr_tree_insert(p);
+            size_tree_insert(p);
+        }
+        ClearPageProperty(page);
+        for (p = page; p != page + take; p ++) {
+            array[got ++] = p;
         }
     }
+    nr_free -= got;
+    return got;
+}
+
+// best_fit_free_pages_bulk - free n single pages, runs of consecutive pages in
+// array are given back as one block
+static void
+best_fit_free_pages_bulk(struct Page **array, size_t n) {
+    size_t i = 0, j;
+    while (i < n) {
+        for (j = i + 1; j < n && array[j] == array[j - 1] + 1; j ++)
+            ;
+        best_fit_free_pages(array[i], j - i);
+        i = j;
+    }
 }
 
 static size_t
@@ -220,7 +283,10 @@ basic_check(void) {
     assert(page2pa(p2) < npage * PGSIZE);
 
     list_entry_t free_list_store = free_list;
+    rb_root_t size_tree_store = size_tree, addr_tree_store = addr_tree;
     list_init(&free_list);
+    rb_root_init(&size_tree);
+    rb_root_init(&addr_tree);
     assert(list_empty(&free_list));
 
     unsigned int nr_free_store = nr_free;
@@ -248,6 +314,7 @@ basic_check(void) {
 
     assert(nr_free == 0);
     free_list = free_list_store;
+    size_tree = size_tree_store, addr_tree = addr_tree_store;
     nr_free = nr_free_store;
 
     free_page(p);
@@ -255,6 +322,89 @@ basic_check(void) {
     free_page(p2);
 }
 
+// check_free_trees - size_tree, addr_tree and free_list must describe the same
+// set of blocks, and no two free blocks may be left uncoalesced
+static void
+check_free_trees(void) {
+    int count = 0;
+    list_entry_t *le = &free_list;
+    rb_node_t *node = rb_first(&addr_tree);
+    while ((le = list_next(le)) != &free_list) {
+        struct Page *p = le2page(le, page_link);
+        assert(node != NULL && addr2page(node) == p && PageProperty(p));
+        if ((node = rb_next(node)) != NULL) {
+            assert(p + p->property < addr2page(node));
+        }
+        count ++;
+    }
+    assert(node == NULL);
+    struct Page *last = NULL;
+    for (node = rb_first(&size_tree); node != NULL; node = rb_next(node), count --) {
+        struct Page *p = size2page(node);
+        assert(last == NULL || last->property < p->property ||
+               (last->property == p->property && last < p));
+        last = p;
+    }
+    assert(count == 0);
+}
+
+#define TREE_CHECK_PAGES    2048
+
+// best_fit_tree_check - fragment memory into ~TREE_CHECK_PAGES/2 single-page
+// holes, then verify best fit picks holes and everything merges back
+static void
+best_fit_tree_check(void) {
+    size_t nr_free_store = nr_free;
+    struct Page *array = alloc_pages(2 * TREE_CHECK_PAGES * sizeof(struct Page *) / PGSIZE);
+    assert(array != NULL);
+    struct Page **p = page2kva(array);
+    int i;
+
+    for (i = 0; i < TREE_CHECK_PAGES; i ++) {
+        assert((p[i] = alloc_page()) != NULL);
+    }
+    for (i = 0; i < TREE_CHECK_PAGES; i += 2) {
+        free_page(p[i]);
+    }
+    check_free_trees();
+    // there are plenty of single-page holes, each 1-page request must take
+    // the lowest one instead of cutting a bigger block
+    for (i = 0; i < TREE_CHECK_PAGES; i += 2) {
+        struct Page *hole = size2page(rb_first(&size_tree));
+        assert(hole->property == 1);
+        assert((p[i] = alloc_page()) == hole);
+    }
+    for (i = 0; i < TREE_CHECK_PAGES; i += 2) {
+        free_page(p[i]);
+    }
+    for (i = 1; i < TREE_CHECK_PAGES; i += 2) {
+        free_page(p[i]);
+    }
+    check_free_trees();
+
+    // bulk: fragment again, a bulk request of that many pages must be served
+    // entirely from the single-page holes
+    for (i = 0; i < TREE_CHECK_PAGES; i ++) {
+        assert((p[i] = alloc_page()) != NULL);
+    }
+    for (i = 0; i < TREE_CHECK_PAGES; i += 2) {
+        free_page(p[i]);
+    }
+    struct Page **bulk = p + TREE_CHECK_PAGES;
+    assert(best_fit_alloc_pages_bulk(TREE_CHECK_PAGES / 2, bulk) == TREE_CHECK_PAGES / 2);
+    for (i = 0; i < TREE_CHECK_PAGES / 2; i ++) {
+        assert(!PageProperty(bulk[i]));
+        assert(i == TREE_CHECK_PAGES / 2 - 1 || bulk[i] + 1 != bulk[i + 1]);
+    }
+    best_fit_free_pages_bulk(bulk, TREE_CHECK_PAGES / 2);
+    for (i = 1; i < TREE_CHECK_PAGES; i += 2) {
+        free_page(p[i]);
+    }
+    check_free_trees();
+    free_pages(array, 2 * TREE_CHECK_PAGES * sizeof(struct Page *) / PGSIZE);
+    assert(nr_free == nr_free_store);
+}
+
 // LAB2: below code is used to check the best fit allocation algorithm (your EXERCISE 1) 
 // NOTICE: You SHOULD NOT CHANGE basic_check, default_check functions!
 static void
@@ -282,7 +432,10 @@ best_fit_check(void) {
     score += 1;
     #endif
     list_entry_t free_list_store = free_list;
+    rb_root_t size_tree_store = size_tree, addr_tree_store = addr_tree;
     list_init(&free_list);
+    rb_root_init(&size_tree);
+    rb_root_init(&addr_tree);
     assert(list_empty(&free_list));
     assert(alloc_page() == NULL);
 
@@ -317,6 +470,7 @@ best_fit_check(void) {
     nr_free = nr_free_store;
 
     free_list = free_list_store;
+    size_tree = size_tree_store, addr_tree = addr_tree_store;
     free_pages(p0, 5);
 
     le = &free_list;
@@ -329,6 +483,8 @@ best_fit_check(void) {
     #ifdef ucore_test
     score += 1;
     #endif
+
+    best_fit_tree_check();
 }
 
 const struct pmm_manager best_fit_pmm_manager = {
@@ -339,4 +495,6 @@ const struct pmm_manager best_fit_pmm_manager = {
     .free_pages = best_fit_free_pages,
     .nr_free_pages = best_fit_nr_free_pages,
     .check = best_fit_check,
+    .alloc_pages_bulk = best_fit_alloc_pages_bulk,
+    .free_pages_bulk = best_fit_free_pages_bulk,
 };
@@ -2,6 +2,8 @@
 #include <list.h>
 #include <string.h>
 #include <default_pmm.h>
+#include <stdio.h>
+#include <riscv.h>
 
 /* In the first fit algorithm, the allocator keeps a list of free blocks (known as the free list) and,
    on receiving a request for memory, scans along the list for the first block that is large enough to
@@ -54,15 +56,65 @@
  *               (5.2) reset the fields of pages, such as p->ref, p->flags (PageProperty)
  *               (5.3) try to merge low addr or high addr blocks. Notice: should change some pages's p->property correctly.
  */
-free_area_t free_area;
+/*
+ * Every NUMA node has its own free_area and addr_tree, free blocks never
+ * span two nodes. Allocation prefers one node and falls back along its
+ * zonelist (see numa_zonelist in pmm.c), nearest node first.
+ */
+free_area_t free_area[MAX_NUMNODES];
+/*
+ * addr_tree indexes the same free blocks as free_list by address. free_pages
+ * finds the free neighbours of the block being freed with one descent instead
+ * of walking free_list to the insert position, so freeing costs O(log n) no
+ * matter how fragmented memory is. Allocation is still a first-fit list walk.
+ */
+static rb_root_t addr_tree[MAX_NUMNODES];
+
+#define free_list(nid) (free_area[nid].free_list)
+#define nr_free(nid) (free_area[nid].nr_free)
 
-#define free_list (free_area.free_list)
-#define nr_free (free_area.nr_free)
+#define addr2page(node) rb_entry((node), struct Page, addr_node)
+
+// free_block_insert - link base into addr_tree, and into free_list right after
+// its address predecessor
+static void
+free_block_insert(struct Page *base) {
+    int nid = page_to_nid(base);
+    rb_node_t **link = &addr_tree[nid].node, *parent = NULL;
+    while (*link != NULL) {
+        parent = *link;
+        link = (base < addr2page(parent)) ? &parent->left : &parent->right;
+    }
+    rb_link_node(&(base->addr_node), parent, link);
+    rb_insert_color(&(base->addr_node), &addr_tree[nid]);
+
+    rb_node_t *prev = rb_prev(&(base->addr_node));
+    list_add((prev == NULL) ? &free_list(nid) : &(addr2page(prev)->page_link), &(base->page_link));
+}
+
+// free_block_replace - p takes over the place of free block old in both
+// free_list and addr_tree, nothing may sort between them
+static void
+free_block_replace(struct Page *old, struct Page *p) {
+    rb_replace_node(&(old->addr_node), &(p->addr_node), &addr_tree[page_to_nid(old)]);
+    list_add(&(old->page_link), &(p->page_link));
+    list_del(&(old->page_link));
+}
+
+// free_block_remove - unlink the free block base from free_list and addr_tree
+static void
+free_block_remove(struct Page *base) {
+    rb_erase(&(base->addr_node), &addr_tree[page_to_nid(base)]);
+    list_del(&(base->page_link));
+}
 
 static void
 default_init(void) {
-    list_init(&free_list);
-    nr_free = 0;
+    for (int nid = 0; nid < MAX_NUMNODES; nid ++) {
+        list_init(&free_list(nid));
+        rb_root_init(&addr_tree[nid]);
+        nr_free(nid) = 0;
+    }
 }
 
 static void
@@ -70,38 +122,25 @@ default_init_memmap(struct Page *base, size_t n) {
     assert(n > 0);
     struct Page *p = base;
     for (; p != base + n; p ++) {
-        assert(PageReserved(p));
+        assert(PageReserved(p) && page_to_nid(p) == page_to_nid(base));
         p->flags = p->property = 0;
         set_page_ref(p, 0);
     }
     base->property = n;
     SetPageProperty(base);
-    nr_free += n;
-    if (list_empty(&free_list)) {
-        list_add(&free_list, &(base->page_link));
-    } else {
-        list_entry_t* le = &free_list;
-        while ((le = list_next(le)) != &free_list) {
-            struct Page* page = le2page(le, page_link);
-            if (base < page) {
-                list_add_before(le, &(base->page_link));
-                break;
-            } else if (list_next(le) == &free_list) {
-                list_add(le, &(base->page_link));
-            }
-        }
-    }
+    nr_free(page_to_nid(base)) += n;
+    free_block_insert(base);
 }
 
+// default_alloc_pages_local - first fit on node nid only
 static struct Page *
-default_alloc_pages(size_t n) {
-    assert(n > 0);
-    if (n > nr_free) {
+default_alloc_pages_local(int nid, size_t n) {
+    if (n > nr_free(nid)) {
         return NULL;
     }
     struct Page *page = NULL;
-    list_entry_t *le = &free_list;
-    while ((le = list_next(le)) != &free_list) {
+    list_entry_t *le = &free_list(nid);
+    while ((le = list_next(le)) != &free_list(nid)) {
         struct Page *p = le2page(le, page_link);
         if (p->property >= n) {
             page = p;
@@ -109,73 +148,147 @@ default_alloc_pages(size_t n) {
         }
     }
     if (page != NULL) {
-        list_entry_t* prev = list_prev(&(page->page_link));
-        list_del(&(page->page_link));
         if (page->property > n) {
             struct Page *p = page + n;
             p->property = page->property - n;
             SetPageProperty(p);
-            list_add(prev, &(p->page_link));
+            free_block_replace(page, p);
+        } else {
+            free_block_remove(page);
         }
-        nr_free -= n;
+        nr_free(nid) -= n;
         ClearPageProperty(page);
     }
     return page;
 }
 
+// default_alloc_pages_node - allocate from node nid, or from the nearest node
+// that has room
+static struct Page *
+default_alloc_pages_node(int nid, size_t n) {
+    assert(n > 0);
+    const int *zonelist = numa_zonelist(nid);
+    struct Page *page = NULL;
+    for (int i = 0; i < nr_numa_nodes && page == NULL; i ++) {
+        page = default_alloc_pages_local(zonelist[i], n);
+    }
+    return page;
+}
+
+static struct Page *
+default_alloc_pages(size_t n) {
+    return default_alloc_pages_node(numa_node_id(), n);
+}
+
 static void
 default_free_pages(struct Page *base, size_t n) {
     assert(n > 0);
+    int nid = page_to_nid(base);
     struct Page *p = base;
     for (; p != base + n; p ++) {
-        assert(!PageReserved(p) && !PageProperty(p));
+        assert(!PageReserved(p) && !PageProperty(p) && page_to_nid(p) == nid);
         p->flags = 0;
         set_page_ref(p, 0);
     }
     base->property = n;
     SetPageProperty(base);
-    nr_free += n;
-
-    if (list_empty(&free_list)) {
-        list_add(&free_list, &(base->page_link));
-    } else {
-        list_entry_t* le = &free_list;
-        while ((le = list_next(le)) != &free_list) {
-            struct Page* page = le2page(le, page_link);
-            if (base < page) {
-                list_add_before(le, &(base->page_link));
-                break;
-            } else if (list_next(le) == &free_list) {
-                list_add(le, &(base->page_link));
-            }
+    nr_free(nid) += n;
+
+    // find the free blocks just below and just above base
+    struct Page *prev = NULL, *next = NULL;
+    rb_node_t *node = addr_tree[nid].node;
+    while (node != NULL) {
+        p = addr2page(node);
+        if (p < base) {
+            prev = p;
+            node = node->right;
+        } else {
+            next = p;
+            node = node->left;
         }
     }
-
-    list_entry_t* le = list_prev(&(base->page_link));
-    if (le != &free_list) {
-        p = le2page(le, page_link);
-        if (p + p->property == base) {
-            p->property += base->property;
-            ClearPageProperty(base);
-            list_del(&(base->page_link));
-            base = p;
+    bool merge_prev = (prev != NULL && prev + prev->property == base);
+    bool merge_next = (next != NULL && base + base->property == next);
+
+    if (merge_prev) {
+        // prev keeps its place, it only grows
+        prev->property += base->property;
+        ClearPageProperty(base);
+        base = prev;
+        if (merge_next) {
+            base->property += next->property;
+            ClearPageProperty(next);
+            free_block_remove(next);
         }
+    } else if (merge_next) {
+        // base swallows next and takes over its place
+        base->property += next->property;
+        ClearPageProperty(next);
+        free_block_replace(next, base);
+    } else {
+        free_block_insert(base);
     }
+}
 
-    le = list_next(&(base->page_link));
-    if (le != &free_list) {
-        p = le2page(le, page_link);
-        if (base + base->property == p) {
-            base->property += p->property;
-            ClearPageProperty(p);
-            list_del(&(p->page_link));
+// default_alloc_pages_bulk - take n single pages from the front of free_list
+// in one pass, using up whole blocks before moving on to the next one. The
+// local node is emptied before the next node on its zonelist is touched.
+static size_t
+default_alloc_pages_bulk(size_t n, struct Page **array) {
+    const int *zonelist = numa_zonelist(numa_node_id());
+    size_t got = 0;
+    for (int i = 0; i < nr_numa_nodes && got < n; i ++) {
+        int nid = zonelist[i];
+        size_t start = got;
+        list_entry_t *le = list_next(&free_list(nid));
+        while (got < n && le != &free_list(nid)) {
+            struct Page *page = le2page(le, page_link), *p;
+            le = list_next(le);
+            size_t take = (page->property < n - got) ? page->property : n - got;
+            if (page->property > take) {
+                p = page + take;
+                p->property = page->property - take;
+                SetPageProperty(p);
+                free_block_replace(page, p);
+            } else {
+                free_block_remove(page);
+            }
+            ClearPageProperty(page);
+            for (p = page; p != page + take; p ++) {
+                array[got ++] = p;
+            }
         }
+        nr_free(nid) -= got - start;
+    }
+    return got;
+}
+
+// default_free_pages_bulk - free n single pages, runs of consecutive pages in
+// array on the same node are given back as one block
+static void
+default_free_pages_bulk(struct Page **array, size_t n) {
+    size_t i = 0, j;
+    while (i < n) {
+        for (j = i + 1; j < n && array[j] == array[j - 1] + 1 &&
+                        page_to_nid(array[j]) == page_to_nid(array[i]); j ++)
+            ;
+        default_free_pages(array[i], j - i);
+        i = j;
     }
 }
 
+static size_t
+default_nr_free_pages_node(int nid) {
+    return nr_free(nid);
+}
+
 static size_t
 default_nr_free_pages(void) {
-    return nr_free;
+    size_t total = 0;
+    for (int nid = 0; nid < MAX_NUMNODES; nid ++) {
+        total += nr_free(nid);
+    }
+    return total;
 }
 
 static void
@@ -193,19 +306,19 @@ basic_check(void) {
     assert(page2pa(p1) < npage * PGSIZE);
     assert(page2pa(p2) < npage * PGSIZE);
 
-    list_entry_t free_list_store = free_list;
-    list_init(&free_list);
-    assert(list_empty(&free_list));
-
-    unsigned int nr_free_store = nr_free;
-    nr_free = 0;
+    free_area_t free_area_store[MAX_NUMNODES];
+    rb_root_t addr_tree_store[MAX_NUMNODES];
+    memcpy(free_area_store, free_area, sizeof(free_area));
+    memcpy(addr_tree_store, addr_tree, sizeof(addr_tree));
+    default_init();
+    assert(default_nr_free_pages() == 0);
 
     assert(alloc_page() == NULL);
 
     free_page(p0);
     free_page(p1);
     free_page(p2);
-    assert(nr_free == 3);
+    assert(default_nr_free_pages() == 3);
 
     assert((p0 = alloc_page()) != NULL);
     assert((p1 = alloc_page()) != NULL);
@@ -214,33 +327,101 @@ basic_check(void) {
     assert(alloc_page() == NULL);
 
     free_page(p0);
-    assert(!list_empty(&free_list));
+    assert(!list_empty(&free_list(page_to_nid(p0))));
 
     struct Page *p;
     assert((p = alloc_page()) == p0);
     assert(alloc_page() == NULL);
 
-    assert(nr_free == 0);
-    free_list = free_list_store;
-    nr_free = nr_free_store;
+    assert(default_nr_free_pages() == 0);
+    memcpy(free_area, free_area_store, sizeof(free_area));
+    memcpy(addr_tree, addr_tree_store, sizeof(addr_tree));
 
     free_page(p);
     free_page(p1);
     free_page(p2);
 }
 
+// check_addr_tree - addr_tree must hold exactly the blocks of free_list in the
+// same order, with no two free blocks left uncoalesced
+static void
+check_addr_tree(void) {
+    for (int nid = 0; nid < MAX_NUMNODES; nid ++) {
+        list_entry_t *le = &free_list(nid);
+        rb_node_t *node = rb_first(&addr_tree[nid]);
+        while ((le = list_next(le)) != &free_list(nid)) {
+            struct Page *p = le2page(le, page_link);
+            assert(node != NULL && addr2page(node) == p && page_to_nid(p) == nid);
+            if ((node = rb_next(node)) != NULL) {
+                assert(p + p->property < addr2page(node));
+            }
+        }
+        assert(node == NULL);
+    }
+}
+
+#ifdef DEFAULT_PMM_BENCH
+#define BENCH_FREES         256
+#define BENCH_MAX_HOLES     4096
+
+// default_bench - time free_pages against the number of free blocks already on
+// free_list. For each level, leave that many single-page holes in front of
+// BENCH_FREES test pages, then free the test pages. Build with
+// DEFS=-DDEFAULT_PMM_BENCH to enable.
+static void
+default_bench(void) {
+    size_t nr_slots = 2 * (BENCH_MAX_HOLES + BENCH_FREES);
+    size_t nr_array = ROUNDUP(nr_slots * sizeof(struct Page *), PGSIZE) / PGSIZE;
+    struct Page *array = alloc_pages(nr_array);
+    assert(array != NULL);
+    struct Page **p = page2kva(array);
+    size_t holes, i;
+
+    for (holes = 0; holes <= BENCH_MAX_HOLES; holes = (holes == 0) ? 16 : holes * 4) {
+        size_t n = 2 * (holes + BENCH_FREES);
+        for (i = 0; i < n; i ++) {
+            assert((p[i] = alloc_page()) != NULL);
+        }
+        for (i = 0; i < 2 * holes; i += 2) {
+            free_page(p[i]);
+        }
+        // the test pages keep their allocated even neighbours, so every free
+        // adds a block instead of merging into an existing one
+        uint64_t start = rdtime();
+        for (i = 2 * holes + 1; i < n; i += 2) {
+            free_page(p[i]);
+        }
+        uint64_t cost = rdtime() - start;
+        cprintf("default_pmm free_pages: %5d free blocks, %d ticks per free\n",
+                holes, (int)(cost / BENCH_FREES));
+        for (i = 1; i < 2 * holes; i += 2) {
+            free_page(p[i]);
+        }
+        for (i = 2 * holes; i < n; i += 2) {
+            free_page(p[i]);
+        }
+        check_addr_tree();
+    }
+    free_pages(array, nr_array);
+}
+#endif /* DEFAULT_PMM_BENCH */
+
 // LAB2: below code is used to check the first fit allocation algorithm 
 // NOTICE: You SHOULD NOT CHANGE basic_check, default_check functions!
 static void
 default_check(void) {
-    int count = 0, total = 0;
-    list_entry_t *le = &free_list;
-    while ((le = list_next(le)) != &free_list) {
-        struct Page *p = le2page(le, page_link);
-        assert(PageProperty(p));
-        count ++, total += p->property;
+    int count = 0, total = 0, nid;
+    list_entry_t *le;
+    for (nid = 0; nid < MAX_NUMNODES; nid ++) {
+        le = &free_list(nid);
+        while ((le = list_next(le)) != &free_list(nid)) {
+            struct Page *p = le2page(le, page_link);
+            assert(PageProperty(p));
+            count ++, total += p->property;
+        }
     }
     assert(total == nr_free_pages());
+    check_addr_tree();
 
     basic_check();
 
@@ -248,14 +429,14 @@ default_check(void) {
     assert(p0 != NULL);
     assert(!PageProperty(p0));
 
-    list_entry_t free_list_store = free_list;
-    list_init(&free_list);
-    assert(list_empty(&free_list));
+    free_area_t free_area_store[MAX_NUMNODES];
+    rb_root_t addr_tree_store[MAX_NUMNODES];
+    memcpy(free_area_store, free_area, sizeof(free_area));
+    memcpy(addr_tree_store, addr_tree, sizeof(addr_tree));
+    default_init();
+    assert(default_nr_free_pages() == 0);
     assert(alloc_page() == NULL);
 
-    unsigned int nr_free_store = nr_free;
-    nr_free = 0;
-
     free_pages(p0 + 2, 3);
     assert(alloc_pages(4) == NULL);
     assert(PageProperty(p0 + 2) && p0[2].property == 3);
@@ -279,19 +460,39 @@ default_check(void) {
     assert((p0 = alloc_pages(5)) != NULL);
     assert(alloc_page() == NULL);
 
-    assert(nr_free == 0);
-    nr_free = nr_free_store;
-
-    free_list = free_list_store;
+    assert(default_nr_free_pages() == 0);
+    memcpy(free_area, free_area_store, sizeof(free_area));
+    memcpy(addr_tree, addr_tree_store, sizeof(addr_tree));
     free_pages(p0, 5);
 
-    le = &free_list;
-    while ((le = list_next(le)) != &free_list) {
-        struct Page *p = le2page(le, page_link);
-        count --, total -= p->property;
+    for (nid = 0; nid < MAX_NUMNODES; nid ++) {
+        le = &free_list(nid);
+        while ((le = list_next(le)) != &free_list(nid)) {
+            struct Page *p = le2page(le, page_link);
+            count --, total -= p->property;
+        }
     }
     assert(count == 0);
     assert(total == 0);
+    check_addr_tree();
+
+    // bulk: one pass hands out the lowest free pages, freeing them restores everything
+    struct Page *bulk[8];
+    nid = numa_node_id();
+    size_t nr_free_store = nr_free(nid);
+    assert(nr_free_store >= 8);
+    p0 = le2page(list_next(&free_list(nid)), page_link);
+    assert(default_alloc_pages_bulk(8, bulk) == 8);
+    assert(nr_free(nid) == nr_free_store - 8);
+    assert(bulk[0] == p0 && !PageProperty(bulk[0]));
+    default_free_pages_bulk(bulk, 8);
+    assert(nr_free(nid) == nr_free_store);
+    assert(le2page(list_next(&free_list(nid)), page_link) == p0);
+    check_addr_tree();
+
+#ifdef DEFAULT_PMM_BENCH
+    default_bench();
+#endif
 }
 
 const struct pmm_manager default_pmm_manager = {
@@ -302,5 +503,9 @@ const struct pmm_manager default_pmm_manager = {
     .free_pages = default_free_pages,
     .nr_free_pages = default_nr_free_pages,
     .check = default_check,
+    .alloc_pages_bulk = default_alloc_pages_bulk,
+    .free_pages_bulk = default_free_pages_bulk,
+    .alloc_pages_node = default_alloc_pages_node,
+    .nr_free_pages_node = default_nr_free_pages_node,
 };
 
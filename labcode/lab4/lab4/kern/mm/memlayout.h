@@ -37,8 +37,12 @@
 #define KERNTOP             (KERNBASE + KMEMSIZE)
 
 #define PHYSICAL_MEMORY_OFFSET      0xFFFFFFFF40000000
+// entry.S maps physical [0x80000000, KERNMAP_PA_END) with a single gigapage
+#define KERNMAP_PA_END              0xC0000000
 
 
+#define MAX_NUMNODES        4                           // # of NUMA nodes the kernel can manage
+
 #define KSTACKPAGE          2                           // # of pages in kernel stack
 #define KSTACKSIZE          (KSTACKPAGE * PGSIZE)       // sizeof kernel stack
 
@@ -47,6 +51,7 @@
 #include <defs.h>
 #include <atomic.h>
 #include <list.h>
+#include <rbtree.h>
 
 typedef uintptr_t pte_t;
 typedef uintptr_t pde_t;
@@ -61,9 +66,13 @@ struct Page {
     int ref;                        // page frame's reference counter
     uint_t flags;                 // array of flags that describe the status of the page frame
     unsigned int property;          // the num of free block, used in first fit pm manager
+    int nid;                        // the NUMA node this page frame belongs to
+    unsigned int pt_entries;        // valid entries, while the page is a page table
     list_entry_t page_link;         // free list link
     list_entry_t pra_page_link;     // used for pra (page replace algorithm)
     uintptr_t pra_vaddr;            // used for pra (page replace algorithm)
+    rb_node_t size_node;            // free block link in the (size, address) ordered tree, used in best fit pm manager
+    rb_node_t addr_node;            // free block link in the address ordered tree
 };
 
 /* Flags describing the status of a page frame */
@@ -62,6 +62,18 @@
 #define PTE_ADDR(pte)   (((uintptr_t)(pte) & ~0x3FF) << (PTXSHIFT - PTE_PPN_SHIFT)) // 清低 10 位标志，再左移 2 位把 PPN 对齐到物理地址位
 #define PDE_ADDR(pde)   PTE_ADDR(pde)                                         // 目录项与表项同格式，复用 PTE_ADDR 取得物理地址
 
+// page table levels: a leaf at level 2/1/0 maps a gigapage/megapage/page    // 说明：Sv39 的叶子 PTE 可以出现在任意一级
+#define PGLEVEL_4K      0                                                     // 第 0 级：4KB 页
+#define PGLEVEL_2M      1                                                     // 第 1 级：2MB 大页（megapage）
+#define PGLEVEL_1G      2                                                     // 第 2 级：1GB 大页（gigapage）
+#define PGLEVEL_SHIFT(level) (PTXSHIFT + 9 * (level))                         // 该级索引在线性地址中的起始位
+#define PGLEVEL_SIZE(level)  ((uintptr_t)1 << PGLEVEL_SHIFT(level))           // 该级一个叶子映射的字节数
+#define PTX_LEVEL(la, level) ((((uintptr_t)(la)) >> PGLEVEL_SHIFT(level)) & 0x1FF) // 取第 level 级的 9 位索引
+
+// a valid entry with any of R/W/X set maps memory, otherwise it points to  // 说明：R/W/X 全 0 的有效项指向下一级页表
+// the next level table
+#define PTE_LEAF(pte)   (((pte) & (PTE_R | PTE_W | PTE_X)) != 0)
+
 /* page directory and page table constants */
 #define NPDEENTRY       512                    // page directory entries per page directory
 #define NPTEENTRY       512                    // page table entries per page table
@@ -70,6 +82,8 @@
 #define PGSHIFT         12                      // log2(PGSIZE)                            // 4KB 的对数位移 12
 #define PTSIZE          (PGSIZE * NPTEENTRY)    // bytes mapped by a page directory entry  // 一个上层表项覆盖 512×4KB=2MB
 #define PTSHIFT         21                      // log2(PTSIZE)                            // 2MB 的对数位移 21
+#define PDSIZE          (PTSIZE * NPDEENTRY)    // bytes mapped by a root directory entry  // 一个根目录项覆盖 512×2MB=1GB
+#define PDSHIFT         30                      // log2(PDSIZE)                            // 1GB 的对数位移 30
 
 #define PTXSHIFT        12                      // offset of PTX in a linear address       // 线性地址中 PTX（VPN[0]）起始位偏移 12
 #define PDX0SHIFT       21                      // offset of PDX0 in a linear address      // 线性地址中 PDX0（VPN[1]）起始位偏移 21
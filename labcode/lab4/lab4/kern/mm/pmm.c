@@ -1,6 +1,7 @@
 //修改：加入完整的页表管理功能（get_pte/page_insert/page_remove等），实现虚拟内存映射与地址转换；
 //在pmm.c中添加了调用kmalloc_init函数,取消了老的kmalloc/kfree的实现；在pmm.h中取消了老的kmalloc/kfree的定义
 #include <default_pmm.h>
+#include <best_fit_pmm.h>
 #include <defs.h>
 #include <error.h>
 #include <kmalloc.h>
@@ -32,14 +33,35 @@ uintptr_t boot_pgdir_pa;
 // physical memory management
 const struct pmm_manager *pmm_manager;
 
+static void tlb_init(void);
+static void kernel_pgdir_changed(pte_t *ptep, pte_t old);
+
 static void check_alloc_page(void);
+static void check_pcp(void);
+static void check_numa(void);
+static void check_zero_pool(void);
 static void check_pgdir(void);
+static void check_huge_pages(void);
+static void check_asid(void);
+static void check_mmu_gather(void);
+static void check_range(void);
+static void check_pgdir_share(void);
+#ifdef PGDIR_BENCH
+static void pgdir_bench(void);
+#endif
 static void check_boot_pgdir(void);
 
 // init_pmm_manager - initialize a pmm_manager instance
+// default_pmm_manager by default; build with DEFS=-DPMM_BEST_FIT to run the
+// red-black tree best_fit_pmm_manager instead, it has no per-node hooks and
+// treats all memory as one node
 static void init_pmm_manager(void)
 {
+#ifdef PMM_BEST_FIT
+    pmm_manager = &best_fit_pmm_manager;
+#else
     pmm_manager = &default_pmm_manager;
+#endif
     cprintf("memory management: %s\n", pmm_manager->name);
     pmm_manager->init();
 }
@@ -50,27 +72,493 @@ static void init_memmap(struct Page *base, size_t n)
     pmm_manager->init_memmap(base, n);
 }
 
-// alloc_pages - call pmm->alloc_pages to allocate a continuous n*PAGESIZE
-// memory
-struct Page *alloc_pages(size_t n)
+/*
+ * Per-CPU page frame cache.
+ * Single-page alloc/free is by far the most common request (page tables,
+ * slob pages, kernel stacks of one page). Each CPU keeps a small list of
+ * free order-0 pages in front of pmm_manager: alloc_page pops from it and
+ * free_page pushes onto it. pmm_manager is only entered to refill the cache
+ * with PCP_BATCH pages when it runs dry, or to drain PCP_BATCH pages when it
+ * grows past PCP_HIGH. Cached pages are allocated as far as pmm_manager is
+ * concerned, they are chained through page_link.
+ * ucore only runs on the boot hart, so there is one cache for now.
+ */
+#define NCPU            1
+#define PCP_LOW         0       // refill when the cache is down to this many pages
+#define PCP_HIGH        64      // drain when the cache holds more than this many pages
+#define PCP_BATCH       16      // pages moved per refill/drain
+
+struct pcp_cache {
+    list_entry_t pages;         // cached free pages, linked by page_link
+    size_t count;               // # of pages in the list
+};
+
+static struct pcp_cache pcp_caches[NCPU];
+// the cache is off until pmm_manager->check has run: the checks swap the
+// manager's free list out and expect alloc_page to see it directly
+static bool pcp_enabled = 0;
+
+static inline struct pcp_cache *this_cpu_pcp(void)
+{
+    return &pcp_caches[0];
+}
+
+static void pcp_init(void)
+{
+    for (int i = 0; i < NCPU; i++)
+    {
+        list_init(&pcp_caches[i].pages);
+        pcp_caches[i].count = 0;
+    }
+}
+
+static inline struct Page *pcp_pop(struct pcp_cache *pcp)
+{
+    list_entry_t *le = list_next(&(pcp->pages));
+    list_del(le);
+    pcp->count--;
+    return le2page(le, page_link);
+}
+
+// pcp_push - cache a free page in the state pmm->free_pages would leave it:
+// no reference (page-table pages are freed with ref 1) and no flags
+static inline void pcp_push(struct pcp_cache *pcp, struct Page *page)
+{
+    assert(!PageReserved(page) && !PageProperty(page));
+    page->flags = 0;
+    set_page_ref(page, 0);
+    list_add(&(pcp->pages), &(page->page_link));
+    pcp->count++;
+}
+
+/*
+ * NUMA nodes.
+ * Each memory bank in the DTB carries the numa-node-id of its memory node,
+ * page_init stamps it into Page.nid before the bank goes to pmm_manager, which
+ * keeps the free pages of every node apart. Every node has a zonelist: all
+ * nodes sorted by their distance from it, itself first. Allocations prefer the
+ * node of the running CPU and walk its zonelist when that node is out of
+ * pages; alloc_pages_node asks for another node explicitly.
+ */
+int nr_numa_nodes = 1;
+static int numa_zonelists[MAX_NUMNODES][MAX_NUMNODES];
+static int cpu_nid[NCPU];
+
+struct numa_stat {
+    size_t hit;                 // pages allocated on this node when it was preferred
+    size_t miss;                // pages allocated on this node although another was preferred
+};
+
+static struct numa_stat numa_stats[MAX_NUMNODES];
+
+// numa_init - build the zonelists once nr_numa_nodes is known
+static void numa_init(void)
+{
+    for (int nid = 0; nid < nr_numa_nodes; nid++)
+    {
+        int *zonelist = numa_zonelists[nid];
+        for (int i = 0; i < nr_numa_nodes; i++)
+        {
+            // insertion sort by distance, ties keep the lower node id first
+            int d = dtb_numa_distance(nid, i), j = i;
+            while (j > 0 && dtb_numa_distance(nid, zonelist[j - 1]) > d)
+            {
+                zonelist[j] = zonelist[j - 1];
+                j--;
+            }
+            zonelist[j] = i;
+        }
+    }
+}
+
+// numa_node_id - the node of the running CPU, always the boot hart for now
+int numa_node_id(void)
+{
+    return cpu_nid[0];
+}
+
+// numa_zonelist - the nr_numa_nodes nodes to try for an allocation that
+// prefers nid, nearest first
+const int *numa_zonelist(int nid)
+{
+    return numa_zonelists[nid];
+}
+
+static inline void numa_account(int nid, struct Page *page, size_t n)
+{
+    if (page != NULL)
+    {
+        if (page_to_nid(page) == nid)
+        {
+            numa_stats[page_to_nid(page)].hit += n;
+        }
+        else
+        {
+            numa_stats[page_to_nid(page)].miss += n;
+        }
+    }
+}
+
+// pmm_alloc - pmm->alloc_pages_node, or pmm->alloc_pages if the manager does
+// not know about nodes. Interrupts must be disabled by the caller.
+static struct Page *pmm_alloc(int nid, size_t n)
+{
+    struct Page *page;
+    if (pmm_manager->alloc_pages_node != NULL)
+    {
+        page = pmm_manager->alloc_pages_node(nid, n);
+    }
+    else
+    {
+        page = pmm_manager->alloc_pages(n);
+    }
+    numa_account(nid, page, n);
+    return page;
+}
+
+// pmm_alloc_bulk - pmm->alloc_pages_bulk, or alloc_pages(1) in a loop if the
+// manager has no bulk hook. Interrupts must be disabled by the caller.
+static size_t pmm_alloc_bulk(size_t n, struct Page **array)
+{
+    size_t got = 0;
+    if (pmm_manager->alloc_pages_bulk != NULL)
+    {
+        got = pmm_manager->alloc_pages_bulk(n, array);
+        for (size_t i = 0; i < got; i++)
+        {
+            numa_account(numa_node_id(), array[i], 1);
+        }
+        return got;
+    }
+    while (got < n && (array[got] = pmm_alloc(numa_node_id(), 1)) != NULL)
+    {
+        got++;
+    }
+    return got;
+}
+
+// pmm_free_bulk - pmm->free_pages_bulk, or free_pages(p, 1) in a loop if the
+// manager has no bulk hook. Interrupts must be disabled by the caller.
+static void pmm_free_bulk(struct Page **array, size_t n)
+{
+    if (pmm_manager->free_pages_bulk != NULL)
+    {
+        pmm_manager->free_pages_bulk(array, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        pmm_manager->free_pages(array[i], 1);
+    }
+}
+
+// pcp_refill - move up to PCP_BATCH pages of the local node from pmm_manager
+// into the cache
+// - pmm->alloc_pages_bulk empties the local node before it falls back along
+//   the zonelist, so asking for no more than the node has keeps remote pages
+//   out of the cache; a manager without nr_free_pages_node has a single node
+static void pcp_refill(struct pcp_cache *pcp)
+{
+    struct Page *batch[PCP_BATCH];
+    size_t n = PCP_BATCH;
+    if (pmm_manager->nr_free_pages_node != NULL &&
+        pmm_manager->nr_free_pages_node(numa_node_id()) < n)
+    {
+        n = pmm_manager->nr_free_pages_node(numa_node_id());
+    }
+    size_t got = pmm_alloc_bulk(n, batch);
+    while (got > 0)
+    {
+        pcp_push(pcp, batch[--got]);
+    }
+}
+
+// pcp_drain - give up to n pages back to pmm_manager, oldest first
+static void pcp_drain(struct pcp_cache *pcp, size_t n)
+{
+    struct Page *batch[PCP_BATCH];
+    size_t nr = 0;
+    while (n-- > 0 && pcp->count > 0)
+    {
+        list_entry_t *le = list_prev(&(pcp->pages));
+        list_del(le);
+        pcp->count--;
+        batch[nr++] = le2page(le, page_link);
+        if (nr == PCP_BATCH)
+        {
+            pmm_free_bulk(batch, nr);
+            nr = 0;
+        }
+    }
+    pmm_free_bulk(batch, nr);
+}
+
+/*
+ * Pre-zeroed page pool.
+ * Page-table pages (and later zero-fill faults) need a cleared page, and
+ * clearing 4 KiB on the allocating path is the bulk of their cost. The idle
+ * thread has nothing better to do, so cpu_idle calls zero_pool_refill to clear
+ * one page at a time until the pool holds ZERO_POOL_HIGH pages, and
+ * alloc_zeroed_page hands them out without touching them again. Pooled pages
+ * are free memory: nr_free_pages counts them, and an allocation that would
+ * fail otherwise takes them back.
+ */
+#define ZERO_POOL_HIGH  64      // the idle loop stops refilling at this many pages
+
+static struct pcp_cache zero_pool;
+// pool pages handed out already cleared / cleared on the spot
+static size_t zero_pool_hit, zero_pool_miss;
+
+static void zero_pool_init(void)
+{
+    list_init(&zero_pool.pages);
+    zero_pool.count = 0;
+}
+
+// zero_pool_drain - give every pooled page back to the manager. Interrupts
+// must be disabled by the caller.
+static void zero_pool_drain(void)
+{
+    while (zero_pool.count > 0)
+    {
+        struct Page *page = pcp_pop(&zero_pool);
+        pmm_manager->free_pages(page, 1);
+    }
+}
+
+// zero_pool_refill - clear one more page for the pool, called by cpu_idle
+// whenever it has nothing to schedule
+// return value: 1 if a page was added
+bool zero_pool_refill(void)
+{
+    bool intr_flag, added = 0;
+    if (zero_pool.count >= ZERO_POOL_HIGH)
+    {
+        return 0;
+    }
+    struct Page *page = alloc_page();
+    if (page != NULL)
+    {
+        // clear with interrupts on, a tick may switch to a runnable thread
+        memset(page2kva(page), 0, PGSIZE);
+        local_intr_save(intr_flag);
+        {
+            if (zero_pool.count < ZERO_POOL_HIGH)
+            {
+                pcp_push(&zero_pool, page);
+                added = 1;
+            }
+        }
+        local_intr_restore(intr_flag);
+        if (!added)
+        {
+            free_page(page);
+        }
+    }
+    return added;
+}
+
+// alloc_zeroed_pages_bulk - allocate n cleared single pages into array, from
+// the pool first, the rest are allocated and cleared here
+// return value: the number of pages stored in array, may be less than n
+size_t alloc_zeroed_pages_bulk(size_t n, struct Page **array)
+{
+    size_t got = 0, cleared;
+    bool intr_flag;
+    local_intr_save(intr_flag);
+    {
+        while (got < n && zero_pool.count > 0)
+        {
+            array[got++] = pcp_pop(&zero_pool);
+        }
+        zero_pool_hit += got;
+    }
+    local_intr_restore(intr_flag);
+    if (got < n)
+    {
+        cleared = got;
+        got += alloc_pages_bulk(n - got, array + got);
+        zero_pool_miss += got - cleared;
+        for (; cleared < got; cleared++)
+        {
+            memset(page2kva(array[cleared]), 0, PGSIZE);
+        }
+    }
+    return got;
+}
+
+// alloc_zeroed_page - allocate one page whose contents are all zero
+struct Page *alloc_zeroed_page(void)
+{
+    struct Page *page;
+    return (alloc_zeroed_pages_bulk(1, &page) == 1) ? page : NULL;
+}
+
+// alloc_pages_node - allocate a continuous n*PAGESIZE memory from node nid, or
+// from the nearest node that has room. Only the local node has a per-CPU cache.
+struct Page *alloc_pages_node(int nid, size_t n)
 {
     struct Page *page = NULL;
     bool intr_flag;
+    assert(nid >= 0 && nid < nr_numa_nodes);
     local_intr_save(intr_flag);
     {
-        page = pmm_manager->alloc_pages(n);
+        if (n == 1 && pcp_enabled && nid == numa_node_id())
+        {
+            struct pcp_cache *pcp = this_cpu_pcp();
+            if (pcp->count <= PCP_LOW)
+            {
+                pcp_refill(pcp);
+            }
+            if (pcp->count > 0)
+            {
+                page = pcp_pop(pcp);
+            }
+            else if (zero_pool.count > 0)
+            {
+                page = pcp_pop(&zero_pool);
+            }
+            else
+            {
+                // the local node is out of pages, go down the zonelist
+                page = pmm_alloc(nid, 1);
+            }
+        }
+        else
+        {
+            page = pmm_alloc(nid, n);
+            if (page == NULL && ((pcp_enabled && this_cpu_pcp()->count > 0) ||
+                                 zero_pool.count > 0))
+            {
+                // cached pages may be the pieces that would make n contiguous
+                if (pcp_enabled)
+                {
+                    pcp_drain(this_cpu_pcp(), this_cpu_pcp()->count);
+                }
+                zero_pool_drain();
+                page = pmm_alloc(nid, n);
+            }
+        }
     }
     local_intr_restore(intr_flag);
     return page;
 }
 
+// alloc_pages - allocate a continuous n*PAGESIZE memory, preferring the node of
+// the running CPU
+struct Page *alloc_pages(size_t n)
+{
+    return alloc_pages_node(numa_node_id(), n);
+}
+
+// alloc_pages_aligned - allocate n (a power of 2) continuous pages whose
+// physical address is aligned to n*PAGESIZE, e.g. the block behind a megapage
+// - the pmm_manager knows no alignment: a run of 2n-1 pages always holds one
+//   such block, the pages before and after it are given back
+struct Page *alloc_pages_aligned(size_t n)
+{
+    assert(n > 0 && (n & (n - 1)) == 0);
+    struct Page *block = alloc_pages(2 * n - 1), *page;
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    page = block + (ROUNDUP(page2pa(block), n * PGSIZE) - page2pa(block)) / PGSIZE;
+    if (page > block)
+    {
+        free_pages(block, page - block);
+    }
+    if (page + n < block + 2 * n - 1)
+    {
+        free_pages(page + n, block + 2 * n - 1 - (page + n));
+    }
+    return page;
+}
+
 // free_pages - call pmm->free_pages to free a continuous n*PAGESIZE memory
 void free_pages(struct Page *base, size_t n)
 {
     bool intr_flag;
     local_intr_save(intr_flag);
     {
-        pmm_manager->free_pages(base, n);
+        if (n == 1 && pcp_enabled && page_to_nid(base) == numa_node_id())
+        {
+            struct pcp_cache *pcp = this_cpu_pcp();
+            pcp_push(pcp, base);
+            if (pcp->count > PCP_HIGH)
+            {
+                pcp_drain(pcp, PCP_BATCH);
+            }
+        }
+        else
+        {
+            pmm_manager->free_pages(base, n);
+        }
+    }
+    local_intr_restore(intr_flag);
+}
+
+// alloc_pages_bulk - allocate n single pages, not necessarily contiguous, into
+// array. The per-CPU cache is used up first, the rest comes from one
+// pmm->alloc_pages_bulk call. All of it happens under one interrupt-disabled
+// section.
+// return value: the number of pages stored in array, may be less than n
+size_t alloc_pages_bulk(size_t n, struct Page **array)
+{
+    size_t got = 0;
+    bool intr_flag;
+    local_intr_save(intr_flag);
+    {
+        if (pcp_enabled)
+        {
+            struct pcp_cache *pcp = this_cpu_pcp();
+            while (got < n && pcp->count > 0)
+            {
+                array[got++] = pcp_pop(pcp);
+            }
+        }
+        if (got < n)
+        {
+            got += pmm_alloc_bulk(n - got, array + got);
+        }
+    }
+    local_intr_restore(intr_flag);
+    return got;
+}
+
+// free_pages_bulk - free the n single pages in array. The per-CPU cache is
+// topped up to PCP_HIGH with local pages first, the rest goes to
+// pmm->free_pages_bulk PCP_BATCH pages at a time, all under one
+// interrupt-disabled section. array itself is left as it is.
+void free_pages_bulk(struct Page **array, size_t n)
+{
+    struct Page *batch[PCP_BATCH];
+    size_t rest = 0;
+    bool intr_flag;
+    local_intr_save(intr_flag);
+    {
+        struct pcp_cache *pcp = this_cpu_pcp();
+        for (size_t i = 0; i < n; i++)
+        {
+            if (pcp_enabled && pcp->count < PCP_HIGH &&
+                page_to_nid(array[i]) == numa_node_id())
+            {
+                pcp_push(pcp, array[i]);
+            }
+            else
+            {
+                batch[rest++] = array[i];
+                if (rest == PCP_BATCH)
+                {
+                    pmm_free_bulk(batch, rest);
+                    rest = 0;
+                }
+            }
+        }
+        if (rest > 0)
+        {
+            pmm_free_bulk(batch, rest);
+        }
     }
     local_intr_restore(intr_flag);
 }
@@ -83,12 +571,75 @@ size_t nr_free_pages(void)
     bool intr_flag;
     local_intr_save(intr_flag);
     {
-        ret = pmm_manager->nr_free_pages();
+        ret = pmm_manager->nr_free_pages() + zero_pool.count;
+        for (int i = 0; i < NCPU; i++)
+        {
+            ret += pcp_caches[i].count;
+        }
+    }
+    local_intr_restore(intr_flag);
+    return ret;
+}
+
+// nr_free_pages_node - the number of free pages on node nid
+size_t nr_free_pages_node(int nid)
+{
+    size_t ret;
+    bool intr_flag;
+    local_intr_save(intr_flag);
+    {
+        if (pmm_manager->nr_free_pages_node != NULL)
+        {
+            ret = pmm_manager->nr_free_pages_node(nid);
+        }
+        else
+        {
+            ret = (nid == 0) ? pmm_manager->nr_free_pages() : 0;
+        }
+        for (int i = 0; i <= NCPU; i++)
+        {
+            // the zero pool is counted like one more cache
+            list_entry_t *head = (i < NCPU) ? &(pcp_caches[i].pages) : &(zero_pool.pages);
+            list_entry_t *le = head;
+            while ((le = list_next(le)) != head)
+            {
+                ret += (page_to_nid(le2page(le, page_link)) == nid);
+            }
+        }
     }
     local_intr_restore(intr_flag);
     return ret;
 }
 
+/* *
+ * page_init_range - hand the free pages of [begin, end) to the pmm_manager,
+ * skipping every reserved region (@rsv is sorted by base)
+ * */
+static void page_init_range(uint64_t begin, uint64_t end,
+                            const struct dtb_mem_region *rsv, int nr_rsv)
+{
+    begin = ROUNDUP(begin, PGSIZE);
+    end = ROUNDDOWN(end, PGSIZE);
+    for (int i = 0; i < nr_rsv && begin < end; i++)
+    {
+        uint64_t rsv_begin = ROUNDDOWN(rsv[i].base, PGSIZE);
+        uint64_t rsv_end = ROUNDUP(rsv[i].base + rsv[i].size, PGSIZE);
+        if (rsv_end <= begin || rsv_begin >= end)
+        {
+            continue;
+        }
+        if (begin < rsv_begin)
+        {
+            init_memmap(pa2page(begin), (rsv_begin - begin) / PGSIZE);
+        }
+        begin = rsv_end;
+    }
+    if (begin < end)
+    {
+        init_memmap(pa2page(begin), (end - begin) / PGSIZE);
+    }
+}
+
 /* pmm_init - initialize the physical memory management */
 static void page_init(void)
 {
@@ -96,22 +647,58 @@ static void page_init(void)
 
     va_pa_offset = PHYSICAL_MEMORY_OFFSET;
 
-    uint64_t mem_begin = get_memory_base();
-    uint64_t mem_size  = get_memory_size();
-    if (mem_size == 0) {
+    const struct dtb_mem_region *mem, *rsv;
+    int nr_mem = dtb_memory_regions(&mem);
+    int nr_rsv = dtb_reserved_regions(&rsv);
+    if (nr_mem == 0) {
         panic("DTB memory info not available");
     }
-    uint64_t mem_end   = mem_begin + mem_size;
 
     cprintf("physcial memory map:\n");
-    cprintf("  memory: 0x%08lx, [0x%08lx, 0x%08lx].\n", mem_size, mem_begin,
-            mem_end - 1);
-
-    uint64_t maxpa = mem_end;
+    uint64_t maxpa = 0;
+    for (int i = 0; i < nr_mem; i++)
+    {
+        uint64_t mem_end = mem[i].base + mem[i].size;
+        cprintf("  memory: 0x%08lx, [0x%08lx, 0x%08lx], node %d.\n", mem[i].size,
+                mem[i].base, mem_end - 1, mem[i].nid);
+        if (mem_end > maxpa)
+        {
+            maxpa = mem_end;
+        }
+        if (mem[i].nid >= nr_numa_nodes)
+        {
+            nr_numa_nodes = mem[i].nid + 1;
+        }
+    }
+    cpu_nid[0] = dtb_boot_cpu_node();
+    if (cpu_nid[0] >= nr_numa_nodes)
+    {
+        nr_numa_nodes = cpu_nid[0] + 1;
+    }
+    numa_init();
+    for (int i = 0; i < nr_rsv; i++)
+    {
+        cprintf("  reserved: 0x%08lx, [0x%08lx, 0x%08lx].\n", rsv[i].size,
+                rsv[i].base, rsv[i].base + rsv[i].size - 1);
+    }
 
-    if (maxpa > KERNTOP)
+    // only what the boot page table maps can be reached through KADDR: the
+    // linear map is the kernel image's offset, PHYSICAL_MEMORY_OFFSET, under
+    // which KERNMAP_PA_END is already the top of the address space
+    if (maxpa > KERNMAP_PA_END)
     {
-        maxpa = KERNTOP;
+        uint64_t lost = 0;
+        for (int i = 0; i < nr_mem; i++)
+        {
+            uint64_t mem_end = mem[i].base + mem[i].size;
+            if (mem_end > KERNMAP_PA_END)
+            {
+                lost += mem_end - ((mem[i].base > KERNMAP_PA_END) ? mem[i].base : KERNMAP_PA_END);
+            }
+        }
+        cprintf("  warning: 0x%08lx bytes (%lu MiB) above 0x%08lx are out of reach, left unused.\n",
+                lost, lost >> 20, (uint64_t)KERNMAP_PA_END);
+        maxpa = KERNMAP_PA_END;
     }
 
     extern char end[];
@@ -122,18 +709,44 @@ static void page_init(void)
     // so stay away from it by adding extra offset to end
     pages = (struct Page *)ROUNDUP((void *)end, PGSIZE);
 
+    // holes between banks keep their Page reserved
     for (size_t i = 0; i < npage - nbase; i++)
     {
         SetPageReserved(pages + i);
+        pages[i].nid = 0;
+    }
+    for (int i = 0; i < nr_mem; i++)
+    {
+        uint64_t mem_begin = ROUNDUP(mem[i].base, PGSIZE);
+        uint64_t mem_end = ROUNDDOWN(mem[i].base + mem[i].size, PGSIZE);
+        if (mem_begin < DRAM_BASE)
+        {
+            mem_begin = DRAM_BASE;
+        }
+        for (uint64_t pa = mem_begin; pa < mem_end && pa < maxpa; pa += PGSIZE)
+        {
+            pa2page(pa)->nid = mem[i].nid;
+        }
     }
 
     uintptr_t freemem = PADDR((uintptr_t)pages + sizeof(struct Page) * (npage - nbase));
 
-    mem_begin = ROUNDUP(freemem, PGSIZE);
-    mem_end = ROUNDDOWN(mem_end, PGSIZE);
-    if (freemem < mem_end)
+    // everything below freemem is the kernel image and pages[]
+    for (int i = 0; i < nr_mem; i++)
     {
-        init_memmap(pa2page(mem_begin), (mem_end - mem_begin) / PGSIZE);
+        uint64_t mem_begin = mem[i].base, mem_end = mem[i].base + mem[i].size;
+        if (mem_begin < freemem)
+        {
+            mem_begin = freemem;
+        }
+        if (mem_end > maxpa)
+        {
+            mem_end = maxpa;
+        }
+        if (mem_begin < mem_end)
+        {
+            page_init_range(mem_begin, mem_end, rsv, nr_rsv);
+        }
     }
     cprintf("vapaofset is %llu\n", va_pa_offset);
 }
@@ -142,24 +755,88 @@ static void enable_paging(void)
     write_csr(satp, 0x8000000000000000 | (boot_pgdir_pa >> RISCV_PGSHIFT));
 }
 
+/* *
+ * Every page-table page counts its valid entries in pt_entries of its struct
+ * Page, so that page_remove and page_remove_range can tell when a table has
+ * nothing left to map and give it back (pt_reclaim). All ptes are therefore
+ * set with pte_install and cleared with pte_clear, which also notice changes
+ * to the kernel half of boot_pgdir (see pgdir_create).
+ * */
+#define KERNEL_PDX1         (NPTEENTRY / 2) // root entries from here on map the upper, kernel half
+#define KERNEL_ROOT_PTE(ptep)                                                  \
+    ((ptep) >= &boot_pgdir_va[KERNEL_PDX1] && (ptep) < &boot_pgdir_va[NPTEENTRY])
+
+// pt_page - the page-table page that holds @ptep
+static inline struct Page *pt_page(pte_t *ptep)
+{
+    return kva2page(ROUNDDOWN(ptep, PGSIZE));
+}
+
+// pte_install - set *ptep to the valid entry @pte
+static inline void pte_install(pte_t *ptep, pte_t pte)
+{
+    pte_t old = *ptep;
+    if (!(old & PTE_V))
+    {
+        pt_page(ptep)->pt_entries++;
+    }
+    *ptep = pte;
+    if (KERNEL_ROOT_PTE(ptep))
+    {
+        kernel_pgdir_changed(ptep, old);
+    }
+}
+
+// pte_clear - invalidate *ptep
+static inline void pte_clear(pte_t *ptep)
+{
+    pte_t old = *ptep;
+    if (old & PTE_V)
+    {
+        pt_page(ptep)->pt_entries--;
+    }
+    *ptep = 0;
+    if (KERNEL_ROOT_PTE(ptep) && (old & PTE_V))
+    {
+        kernel_pgdir_changed(ptep, old);
+    }
+}
+
 // boot_map_segment - setup&enable the paging mechanism
 // parameters
 //  la:   linear address of this memory need to map (after x86 segment map)
 //  size: memory size
 //  pa:   physical address of this memory
 //  perm: permission of this memory
+// note: each step uses the largest leaf (gigapage, megapage or page) that la,
+//       pa and the rest of the segment are aligned to; perm must then contain
+//       one of PTE_R/PTE_W/PTE_X. The entries of one table are filled after
+//       a single walk.
 static void boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size,
                              uintptr_t pa, uint32_t perm)
 {
     assert(PGOFF(la) == PGOFF(pa));
-    size_t n = ROUNDUP(size + PGOFF(la), PGSIZE) / PGSIZE;
+    size_t left = ROUNDUP(size + PGOFF(la), PGSIZE);
     la = ROUNDDOWN(la, PGSIZE);
     pa = ROUNDDOWN(pa, PGSIZE);
-    for (; n > 0; n--, la += PGSIZE, pa += PGSIZE)
+    while (left > 0)
     {
-        pte_t *ptep = get_pte(pgdir, la, 1);
-        assert(ptep != NULL);
-        *ptep = pte_create(pa >> PGSHIFT, PTE_V | perm);
+        int level = PGLEVEL_1G;
+        while (level > PGLEVEL_4K &&
+               ((la | pa) % PGLEVEL_SIZE(level) != 0 || left < PGLEVEL_SIZE(level)))
+        {
+            level--;
+        }
+        assert(level == PGLEVEL_4K || PTE_LEAF(perm));
+        int lv;
+        pte_t *ptep = get_pte_level(pgdir, la, level, 1, &lv);
+        assert(ptep != NULL && lv == level);
+        do
+        {
+            pte_install(ptep++, pte_create(pa >> PGSHIFT, PTE_V | perm));
+            la += PGLEVEL_SIZE(level), pa += PGLEVEL_SIZE(level);
+            left -= PGLEVEL_SIZE(level);
+        } while (left >= PGLEVEL_SIZE(level) && PTX_LEVEL(la, level) != 0);
     }
 }
 
@@ -191,6 +868,8 @@ void pmm_init(void)
     // Then pmm can alloc/free the physical memory.
     // Now the first_fit/best_fit/worst_fit/buddy_system pmm are available.
     init_pmm_manager();
+    pcp_init();
+    zero_pool_init();
 
     // detect physical memory space, reserve already used memory,
     // then use pmm->init_memmap to create free page list
@@ -199,12 +878,26 @@ void pmm_init(void)
     // use pmm->check to verify the correctness of the alloc/free function in a
     // pmm
     check_alloc_page();
+    pcp_enabled = 1;
+    check_pcp();
+    check_numa();
+    check_zero_pool();
     // create boot_pgdir, an initial page directory(Page Directory Table, PDT)
     extern char boot_page_table_sv39[];
     boot_pgdir_va = (pte_t *)boot_page_table_sv39;
     boot_pgdir_pa = PADDR(boot_pgdir_va);
 
+    tlb_init();
+
     check_pgdir();
+    check_huge_pages();
+    check_asid();
+    check_mmu_gather();
+    check_range();
+    check_pgdir_share();
+#ifdef PGDIR_BENCH
+    pgdir_bench();
+#endif
 
     static_assert(KERNBASE % PTSIZE == 0 && KERNTOP % PTSIZE == 0);
 
@@ -215,45 +908,81 @@ void pmm_init(void)
     kmalloc_init();
 }
 
-// get_pte - get pte and return the kernel virtual address of this pte for la
-//        - if the PT contians this pte didn't exist, alloc a page for PT
+// walks from the root down the page tables, see check_range
+static size_t nr_pte_walks;
+
+// get_pte_level - find the pte that maps la at page-table @level, or the leaf
+//                 that already maps it at a higher level
+//               - with @create, alloc the page-table pages missing above @level
 // parameter:
-//  pgdir:  the kernel virtual base address of PDT
-//  la:     the linear address need to map
-//  create: a logical value to decide if alloc a page for PT
+//  pgdir:       the kernel virtual base address of PDT
+//  la:          the linear address need to map
+//  level:       PGLEVEL_4K, PGLEVEL_2M or PGLEVEL_1G
+//  create:      a logical value to decide if alloc pages for PT
+//  level_store: if not NULL, gets the level of the returned pte, or with
+//               NULL returned, the level of the entry found missing
 // return vaule: the kernel virtual address of this pte
-pte_t *get_pte(pde_t *pgdir, uintptr_t la, bool create)
+pte_t *get_pte_level(pde_t *pgdir, uintptr_t la, int level, bool create,
+                     int *level_store)
 {
-    pde_t *pdep1 = &pgdir[PDX1(la)];
-    if (!(*pdep1 & PTE_V))
+    pte_t *ptep = &pgdir[PDX1(la)];
+    int lv = PGLEVEL_1G;
+    nr_pte_walks++;
+    while (lv > level && (*ptep & PTE_V) && !PTE_LEAF(*ptep))
     {
-        struct Page *page;
-        if (!create || (page = alloc_page()) == NULL)
-        {
-            return NULL;
-        }
-        set_page_ref(page, 1);
-        uintptr_t pa = page2pa(page);
-        memset(KADDR(pa), 0, PGSIZE);
-        *pdep1 = pte_create(page2ppn(page), PTE_U | PTE_V);
+        ptep = &((pte_t *)KADDR(PDE_ADDR(*ptep)))[PTX_LEVEL(la, lv - 1)];
+        lv--;
     }
-    pde_t *pdep0 = &((pte_t *)KADDR(PDE_ADDR(*pdep1)))[PDX0(la)];
-    if (!(*pdep0 & PTE_V))
+    if (lv > level && !(*ptep & PTE_V))
     {
-        struct Page *page;
-        if (!create || (page = alloc_page()) == NULL)
+        // every table below a missing one is missing too, fetch all the
+        // page-table pages this walk needs with one bulk allocation, already
+        // cleared if the zero pool has them
+        struct Page *tables[PGLEVEL_1G];
+        size_t need = lv - level, used = 0, got = 0;
+        if (!create || (got = alloc_zeroed_pages_bulk(need, tables)) < need)
         {
+            if (create)
+            {
+                free_pages_bulk(tables, got);
+            }
+            if (level_store != NULL)
+            {
+                *level_store = lv;
+            }
             return NULL;
         }
-        set_page_ref(page, 1);
-        uintptr_t pa = page2pa(page);
-        memset(KADDR(pa), 0, PGSIZE);
-        *pdep0 = pte_create(page2ppn(page), PTE_U | PTE_V);
+        for (; lv > level; lv--)
+        {
+            struct Page *page = tables[used++];
+            set_page_ref(page, 1);
+            page->pt_entries = 0;
+            pte_install(ptep, pte_create(page2ppn(page), PTE_U | PTE_V));
+            ptep = &((pte_t *)KADDR(PDE_ADDR(*ptep)))[PTX_LEVEL(la, lv - 1)];
+        }
+    }
+    if (level_store != NULL)
+    {
+        *level_store = lv;
     }
-    return &((pte_t *)KADDR(PDE_ADDR(*pdep0)))[PTX(la)];
+    return ptep;
+}
+
+// get_pte - get pte and return the kernel virtual address of this pte for la
+//        - if the PT contians this pte didn't exist, alloc a page for PT
+//        - if la is inside a megapage or gigapage, that leaf pte is returned
+// parameter:
+//  pgdir:  the kernel virtual base address of PDT
+//  la:     the linear address need to map
+//  create: a logical value to decide if alloc a page for PT
+// return vaule: the kernel virtual address of this pte
+pte_t *get_pte(pde_t *pgdir, uintptr_t la, bool create)
+{
+    return get_pte_level(pgdir, la, PGLEVEL_4K, create, NULL);
 }
 
 // get_page - get related Page struct for linear address la using PDT pgdir
+//          - for a megapage or gigapage this is the first Page of the block
 struct Page *get_page(pde_t *pgdir, uintptr_t la, pte_t **ptep_store)
 {
     pte_t *ptep = get_pte(pgdir, la, 0);
@@ -270,33 +999,182 @@ struct Page *get_page(pde_t *pgdir, uintptr_t la, pte_t **ptep_store)
 
 // page_remove_pte - free an Page sturct which is related linear address la
 //                - and clean(invalidate) pte which is related linear address la
-// note: PT is changed, so the TLB need to be invalidate
-static inline void page_remove_pte(pde_t *pgdir, uintptr_t la, pte_t *ptep)
+//                - a leaf at a higher @level maps, and frees, the whole block
+// note: PT is changed, so the TLB need to be invalidate; @tlb gathers the
+//       address and the page, which is only freed after that flush
+static inline void page_remove_pte(struct mmu_gather *tlb, uintptr_t la,
+                                   pte_t *ptep, int level)
 {
     if (*ptep & PTE_V)
     { //(1) check if this page table entry is
         struct Page *page =
             pte2page(*ptep); //(2) find corresponding page to pte
         page_ref_dec(page);  //(3) decrease page reference
-        if (page_ref(page) ==
-            0)
-        { //(4) and free this page when page reference reachs 0
-            free_page(page);
+        pte_clear(ptep);     //(4) clear second page table entry
+        //(5) flush tlb, and free this page when page reference reachs 0
+        tlb_remove_page(tlb, la, level, (page_ref(page) == 0) ? page : NULL);
+    }
+}
+
+// page_remove_table - unmap everything the page table behind *pdep (an entry
+// at @level for linear address la) maps, then free the table itself
+static void page_remove_table(struct mmu_gather *tlb, uintptr_t la, pde_t *pdep,
+                              int level)
+{
+    pte_t *pt = (pte_t *)KADDR(PDE_ADDR(*pdep));
+    for (int i = 0; i < NPTEENTRY; i++, la += PGLEVEL_SIZE(level - 1))
+    {
+        if (level - 1 > PGLEVEL_4K && (pt[i] & PTE_V) && !PTE_LEAF(pt[i]))
+        {
+            page_remove_table(tlb, la, &pt[i], level - 1);
+        }
+        else
+        {
+            page_remove_pte(tlb, la, &pt[i], level - 1);
+        }
+    }
+    struct Page *table = pde2page(*pdep);
+    pte_clear(pdep);
+    tlb_remove_table(tlb, table);
+}
+
+// pt_reclaim - @ptep, the entry for la, has just been cleared: if that left
+// its table empty, unlink and free it, and so on up the tree (the root table
+// itself stays, and so do the shared tables under its kernel half); costs a
+// walk only when there is a table to free
+static void pt_reclaim(struct mmu_gather *tlb, pde_t *pgdir, uintptr_t la,
+                       pte_t *ptep)
+{
+    pde_t *path[PGLEVEL_1G + 1]; // path[lv]: the entry at level lv for la
+    int lv = PGLEVEL_1G;
+    if (pt_page(ptep)->pt_entries != 0)
+    {
+        return;
+    }
+    nr_pte_walks++;
+    path[lv] = &pgdir[PDX1(la)];
+    while (lv > PGLEVEL_4K && (*path[lv] & PTE_V) && !PTE_LEAF(*path[lv]))
+    {
+        path[lv - 1] = &((pte_t *)KADDR(PDE_ADDR(*path[lv])))[PTX_LEVEL(la, lv - 1)];
+        lv--;
+    }
+    for (; lv < PGLEVEL_1G && pt_page(path[lv])->pt_entries == 0; lv++)
+    {
+        if (lv + 1 == PGLEVEL_1G && PDX1(la) >= KERNEL_PDX1)
+        {
+            break;
         }
-        *ptep = 0;                 //(5) clear second page table entry
-        tlb_invalidate(pgdir, la); //(6) flush tlb
+        struct Page *table = pde2page(*path[lv + 1]);
+        pte_clear(path[lv + 1]);
+        tlb_remove_table(tlb, table);
+    }
+}
+
+// pte_split - replace the megapage or gigapage leaf *ptep (for la, at @level)
+// with a page table of leaves one level down that map the same memory with
+// the same permissions
+//  - the block must not be mapped anywhere else: the reference counted on its
+//    first page is now counted on the first page of each smaller block
+//  - page_remove, page_insert and the range functions split a leaf this way
+//    when they change only part of what it maps
+// return value: 0 or -E_NO_MEM
+static int pte_split(struct mmu_gather *tlb, uintptr_t la, pte_t *ptep,
+                     int level)
+{
+    struct Page *head = pte2page(*ptep), *table;
+    size_t step = PGLEVEL_SIZE(level - 1) / PGSIZE;
+    pte_t perm = *ptep & (PTE_USER | PTE_G | PTE_A | PTE_D);
+    assert(level > PGLEVEL_4K && PTE_LEAF(*ptep) && page_ref(head) <= 1);
+    if ((table = alloc_zeroed_page()) == NULL)
+    {
+        return -E_NO_MEM;
+    }
+    pte_t *pt = page2kva(table);
+    set_page_ref(table, 1);
+    table->pt_entries = 0;
+    for (int i = 0; i < NPTEENTRY; i++)
+    {
+        set_page_ref(head + i * step, page_ref(head));
+        pte_install(&pt[i], pte_create(page2ppn(head + i * step), perm));
     }
+    pte_install(ptep, pte_create(page2ppn(table), PTE_U | PTE_V));
+    tlb_remove_page(tlb, la, level, NULL);
+    return 0;
 }
 
 // page_remove - free an Page which is related linear address la and has an
-// validated pte
-void page_remove(pde_t *pgdir, uintptr_t la)
+// validated pte; a megapage or gigapage around it is split first (pte_split),
+// so only that page is unmapped. Page tables left empty are freed as well.
+// return value: 0, or -E_NO_MEM if a split found no page for the new page
+//               table (nothing is unmapped then)
+int page_remove(pde_t *pgdir, uintptr_t la)
 {
-    pte_t *ptep = get_pte(pgdir, la, 0);
+    int level, ret = 0;
+    pte_t *ptep = get_pte_level(pgdir, la, PGLEVEL_4K, 0, &level);
     if (ptep != NULL)
     {
-        page_remove_pte(pgdir, la, ptep);
+        struct mmu_gather tlb;
+        tlb_gather_mmu(&tlb, pgdir);
+        while (level > PGLEVEL_4K && (ret = pte_split(&tlb, la, ptep, level)) == 0)
+        {
+            ptep = get_pte_level(pgdir, la, PGLEVEL_4K, 0, &level);
+        }
+        if (ret == 0)
+        {
+            page_remove_pte(&tlb, la, ptep, PGLEVEL_4K);
+            pt_reclaim(&tlb, pgdir, la, ptep);
+        }
+        tlb_finish_mmu(&tlb);
+    }
+    return ret;
+}
+
+// page_insert_level - map @page at la with a leaf at page-table @level,
+// replacing whatever mapped la before: the part of a larger leaf around it,
+// which is split first (pte_split), or the page table (and everything it
+// maps) that the new leaf takes the place of
+static int page_insert_level(pde_t *pgdir, struct Page *page, uintptr_t la,
+                             uint32_t perm, int level)
+{
+    struct mmu_gather tlb;
+    int lv;
+    tlb_gather_mmu(&tlb, pgdir);
+    pte_t *ptep = get_pte_level(pgdir, la, level, 1, &lv);
+    while (ptep != NULL && lv > level)
+    {
+        if (pte_split(&tlb, la, ptep, lv) != 0)
+        {
+            ptep = NULL;
+            break;
+        }
+        ptep = get_pte_level(pgdir, la, level, 1, &lv);
+    }
+    if (ptep == NULL)
+    {
+        tlb_finish_mmu(&tlb);
+        return -E_NO_MEM;
+    }
+    page_ref_inc(page);
+    if (level > PGLEVEL_4K && (*ptep & PTE_V) && !PTE_LEAF(*ptep))
+    {
+        page_remove_table(&tlb, la, ptep, level);
+    }
+    if (*ptep & PTE_V)
+    {
+        struct Page *p = pte2page(*ptep);
+        if (p == page)
+        {
+            page_ref_dec(page);
+        }
+        else
+        {
+            page_remove_pte(&tlb, la, ptep, level);
+        }
     }
+    pte_install(ptep, pte_create(page2ppn(page), PTE_V | perm));
+    tlb_remove_page(&tlb, la, level, NULL);
+    tlb_finish_mmu(&tlb);
+    return 0;
 }
 
 // page_insert - build the map of phy addr of an Page with the linear addr la
@@ -309,44 +1187,842 @@ void page_remove(pde_t *pgdir, uintptr_t la)
 // note: PT is changed, so the TLB need to be invalidate
 int page_insert(pde_t *pgdir, struct Page *page, uintptr_t la, uint32_t perm)
 {
-    pte_t *ptep = get_pte(pgdir, la, 1);
-    if (ptep == NULL)
+    return page_insert_level(pgdir, page, la, perm, PGLEVEL_4K);
+}
+
+// page_insert_huge - map the PGLEVEL_SIZE(level) bytes starting at @page with
+// one megapage (PGLEVEL_2M) or gigapage (PGLEVEL_1G) leaf at la
+//  - la and the physical address of @page must be aligned to that size, and
+//    the pages behind @page physically contiguous (e.g. one alloc_pages block)
+//  - @perm must contain one of PTE_R/PTE_W/PTE_X, or the entry would be
+//    taken as a pointer to a page table
+//  - the reference is counted on @page only, and unmapping the whole leaf
+//    frees the whole block once it drops to 0; page_remove and page_insert
+//    of a page inside it split it instead (pte_split)
+int page_insert_huge(pde_t *pgdir, struct Page *page, uintptr_t la,
+                     uint32_t perm, int level)
+{
+    assert(level == PGLEVEL_2M || level == PGLEVEL_1G);
+    assert(la % PGLEVEL_SIZE(level) == 0);
+    assert(page2pa(page) % PGLEVEL_SIZE(level) == 0);
+    assert(PTE_LEAF(perm));
+    return page_insert_level(pgdir, page, la, perm, level);
+}
+
+// page_split - map the megapage or gigapage that la is inside with leaves one
+// level down instead, see pte_split; nothing to do if la is not in one
+// return value: 0 or -E_NO_MEM
+int page_split(pde_t *pgdir, uintptr_t la)
+{
+    struct mmu_gather tlb;
+    int lv, ret = 0;
+    pte_t *ptep = get_pte_level(pgdir, la, PGLEVEL_4K, 0, &lv);
+    if (ptep != NULL && lv > PGLEVEL_4K)
     {
-        return -E_NO_MEM;
+        tlb_gather_mmu(&tlb, pgdir);
+        ret = pte_split(&tlb, la, ptep, lv);
+        tlb_finish_mmu(&tlb);
     }
-    page_ref_inc(page);
-    if (*ptep & PTE_V)
+    return ret;
+}
+
+// pgdir_alloc_page - map a newly allocated, cleared page at la with perm
+// return value: the page, or NULL if no page or page table could be had
+struct Page *pgdir_alloc_page(pde_t *pgdir, uintptr_t la, uint32_t perm)
+{
+    struct Page *page = alloc_zeroed_page();
+    if (page != NULL && page_insert(pgdir, page, la, perm) != 0)
     {
-        struct Page *p = pte2page(*ptep);
-        if (p == page)
+        free_page(page);
+        page = NULL;
+    }
+    return page;
+}
+
+// page_insert_range - map the n pages in @array at la, la + PGSIZE, ... like
+// n page_insert calls, but walking down from the root only once per leaf
+// page table: the ptes within it are taken one after another, and the walk is
+// redone when la crosses into the next 2 MiB
+// return value: 0, or -E_NO_MEM if a page table could not be allocated (the
+//               pages before la are mapped then)
+int page_insert_range(pde_t *pgdir, struct Page **array, uintptr_t la,
+                      size_t n, uint32_t perm)
+{
+    struct mmu_gather tlb;
+    pte_t *ptep = NULL;
+    int lv;
+    tlb_gather_mmu(&tlb, pgdir);
+    for (size_t i = 0; i < n; i++, la += PGSIZE, ptep++)
+    {
+        if (ptep == NULL || PTX(la) == 0)
         {
-            page_ref_dec(page);
+            ptep = get_pte_level(pgdir, la, PGLEVEL_4K, 1, &lv);
+            while (ptep != NULL && lv > PGLEVEL_4K)
+            {
+                if (pte_split(&tlb, la, ptep, lv) != 0)
+                {
+                    ptep = NULL;
+                    break;
+                }
+                ptep = get_pte_level(pgdir, la, PGLEVEL_4K, 1, &lv);
+            }
+            if (ptep == NULL)
+            {
+                tlb_finish_mmu(&tlb);
+                return -E_NO_MEM;
+            }
         }
-        else
+        page_ref_inc(array[i]);
+        if (*ptep & PTE_V)
         {
-            page_remove_pte(pgdir, la, ptep);
+            if (pte2page(*ptep) == array[i])
+            {
+                page_ref_dec(array[i]);
+            }
+            else
+            {
+                page_remove_pte(&tlb, la, ptep, PGLEVEL_4K);
+            }
         }
+        pte_install(ptep, pte_create(page2ppn(array[i]), PTE_V | perm));
+        tlb_remove_page(&tlb, la, PGLEVEL_4K, NULL);
     }
-    *ptep = pte_create(page2ppn(page), PTE_V | perm);
-    tlb_invalidate(pgdir, la);
+    tlb_finish_mmu(&tlb);
     return 0;
 }
 
+// page_remove_range - unmap the n pages at la, la + PGSIZE, ... like n
+// page_remove calls, walking down from the root only once per leaf page table;
+// a missing page table skips everything it would have mapped, a megapage or
+// gigapage inside the range is unmapped whole, one the range only partly
+// covers is split first (pte_split), and page tables left empty are freed
+// return value: 0, or -E_NO_MEM if a split found no page for the new page
+//               table (the pages before la are unmapped then)
+int page_remove_range(pde_t *pgdir, uintptr_t la, size_t n)
+{
+    struct mmu_gather tlb;
+    pte_t *ptep;
+    int lv, ret = 0;
+    tlb_gather_mmu(&tlb, pgdir);
+    while (n > 0)
+    {
+        ptep = get_pte_level(pgdir, la, PGLEVEL_4K, 0, &lv);
+        if (ptep == NULL || lv > PGLEVEL_4K)
+        {
+            if (ptep != NULL && (la % PGLEVEL_SIZE(lv) != 0 || n < PGLEVEL_SIZE(lv) / PGSIZE))
+            {
+                if ((ret = pte_split(&tlb, la, ptep, lv)) != 0)
+                {
+                    break;
+                }
+                continue;
+            }
+            if (ptep != NULL)
+            {
+                page_remove_pte(&tlb, la, ptep, lv);
+                pt_reclaim(&tlb, pgdir, la, ptep);
+            }
+            // on to the next entry at that level
+            size_t skip = (PGLEVEL_SIZE(lv) - la % PGLEVEL_SIZE(lv)) / PGSIZE;
+            if (skip >= n)
+            {
+                break;
+            }
+            la += skip * PGSIZE, n -= skip;
+            continue;
+        }
+        do
+        {
+            page_remove_pte(&tlb, la, ptep, PGLEVEL_4K);
+            la += PGSIZE, ptep++, n--;
+        } while (n > 0 && PTX(la) != 0);
+        pt_reclaim(&tlb, pgdir, la - PGSIZE, ptep - 1);
+    }
+    tlb_finish_mmu(&tlb);
+    return ret;
+}
+
+// copy_pte - map what *ptep (for la, at @level, in the page table tlb is for)
+// maps at the empty entry *nptep of another page table as well
+//  - share: the same page, made read-only in both so that the first write on
+//    either side copies it (see do_pgfault)
+//  - else a new copy of the page
+// return value: 0 or -E_NO_MEM
+static int copy_pte(struct mmu_gather *tlb, pte_t *nptep, uintptr_t la,
+                    pte_t *ptep, int level, bool share)
+{
+    struct Page *page = pte2page(*ptep);
+    assert(!(*nptep & PTE_V));
+    if (share)
+    {
+        if (*ptep & PTE_W)
+        {
+            *ptep &= ~PTE_W;
+            tlb_remove_page(tlb, la, level, NULL);
+        }
+        page_ref_inc(page);
+        pte_install(nptep, *ptep);
+    }
+    else
+    {
+        struct Page *npage = alloc_page();
+        if (npage == NULL)
+        {
+            return -E_NO_MEM;
+        }
+        memcpy(page2kva(npage), page2kva(page), PGSIZE);
+        page_ref_inc(npage);
+        pte_install(nptep, pte_create(page2ppn(npage), *ptep & (PTE_U | PTE_R | PTE_W | PTE_X)));
+    }
+    return 0;
+}
+
+// copy_range - copy the mappings of [start, end) in @from to @to, which has
+// none there, with copy_pte; one walk from the root of each page table per
+// leaf page table of @from, a missing table skips what it would have mapped,
+// and a megapage or gigapage of @from is split first (pte_split), so that its
+// pages are copied or shared one by one like any other
+// return value: 0, or -E_NO_MEM (the mappings before the failure are copied)
+int copy_range(pde_t *to, pde_t *from, uintptr_t start, uintptr_t end,
+               bool share)
+{
+    struct mmu_gather tlb;
+    pte_t *ptep, *nptep;
+    int lv, ret = 0;
+    assert(start % PGSIZE == 0 && end % PGSIZE == 0);
+    tlb_gather_mmu(&tlb, from);
+    while (start < end && ret == 0)
+    {
+        ptep = get_pte_level(from, start, PGLEVEL_4K, 0, &lv);
+        if (ptep == NULL || lv > PGLEVEL_4K)
+        {
+            if (ptep != NULL)
+            {
+                ret = pte_split(&tlb, start, ptep, lv);
+                continue;
+            }
+            start = ROUNDDOWN(start, PGLEVEL_SIZE(lv)) + PGLEVEL_SIZE(lv);
+            continue;
+        }
+        nptep = NULL;
+        do
+        {
+            if ((*ptep & PTE_V) && nptep == NULL &&
+                (nptep = get_pte(to, start, 1)) == NULL)
+            {
+                ret = -E_NO_MEM;
+                break;
+            }
+            if ((*ptep & PTE_V) && (ret = copy_pte(&tlb, nptep, start, ptep, PGLEVEL_4K, share)) != 0)
+            {
+                break;
+            }
+            start += PGSIZE, ptep++;
+            nptep = (nptep != NULL) ? nptep + 1 : NULL;
+        } while (start < end && PTX(start) != 0);
+    }
+    tlb_finish_mmu(&tlb);
+    return ret;
+}
+
+/* *
+ * ASIDs - satp carries an address-space identifier (up to 16 bits, fewer or
+ * none on some harts) that tags every TLB entry, so switching to an address
+ * space with its own ASID needs no flush at all.
+ *
+ * An address space is handed the next ASID the first time it is switched to
+ * and keeps it, together with the generation it was handed out in, in the
+ * 64-bit context passed to switch_pgdir (mm_struct.asid). ASIDs are never
+ * given back: once they run out, asid_new starts a new generation, the
+ * switch that did so flushes the whole TLB after writing satp, and every
+ * address space then picks up a new ASID on its next switch. ASID 0
+ * (ASID_KERNEL) is the kernel's.
+ * */
+#define ASID_MAX_BITS       16
+#define ASID_MASK           ((1UL << ASID_MAX_BITS) - 1)
+#define SATP64_ASID_SHIFT   44
+
+static int asid_bits;                                   // ASID bits the hart implements
+static uint64_t asid_generation = 1UL << ASID_MAX_BITS; // current generation, above the ASID bits
+static uint64_t asid_next = ASID_KERNEL + 1;            // next ASID to hand out in this generation
+static uintptr_t active_pgdir;                          // physical address of the page table in satp
+static uint64_t active_asid;                            // and the ASID it is loaded with
+static bool has_svinval;                                // sinval.vma and friends, see mmu_gather
+
+struct asid_stat
+{
+    size_t switches;  // satp writes
+    size_t skipped;   // switch_pgdir calls that found the address space already loaded
+    size_t rollovers; // new generations, i.e. whole TLB flushes
+};
+static struct asid_stat asid_stats;
+
+// tlb_init - find the implemented satp.ASID bits (the field is WARL, the
+// bits that stick are the ones that exist), and whether the hart has Svinval;
+// boot_pgdir is in satp with ASID 0
+static void tlb_init(void)
+{
+    uintptr_t satp = read_csr(satp);
+    write_csr(satp, satp | SATP64_ASID);
+    uint64_t bits = (read_csr(satp) & SATP64_ASID) >> SATP64_ASID_SHIFT;
+    write_csr(satp, satp);
+    for (asid_bits = 0; bits & 1; bits >>= 1)
+    {
+        asid_bits++;
+    }
+    active_pgdir = boot_pgdir_pa;
+    active_asid = ASID_KERNEL;
+    has_svinval = dtb_isa_has("svinval");
+    cprintf("tlb: %d ASID bits, %s\n", asid_bits,
+            has_svinval ? "Svinval" : "no Svinval");
+}
+
+// asid_new - hand out the next ASID of the current generation, or start a new
+// generation if there is none left; the caller then flushes the TLB, see
+// switch_pgdir
+static uint64_t asid_new(void)
+{
+    if (asid_next >= (1UL << asid_bits))
+    {
+        asid_generation += 1UL << ASID_MAX_BITS;
+        asid_next = ASID_KERNEL + 1;
+        asid_stats.rollovers++;
+    }
+    // a hart without ASIDs runs everything as ASID 0, flushing on each switch
+    uint64_t asid = (asid_next < (1UL << asid_bits)) ? asid_next++ : ASID_KERNEL;
+    return asid_generation | asid;
+}
+
+// switch_pgdir - load the page table at physical address @pgdir into satp,
+// tagged with the ASID in the context *@asid (renewed first if it is from an
+// older generation), or with ASID_KERNEL if @asid is NULL. Nothing is written
+// if that page table is already loaded with that ASID. A new generation
+// flushes the whole TLB after satp is written, not before: until then the
+// hart may still walk the outgoing page table and cache what it finds under
+// the old ASID, which the new generation hands out again.
+void switch_pgdir(uintptr_t pgdir, uint64_t *asid)
+{
+    uint64_t id = ASID_KERNEL, generation = asid_generation;
+    if (asid != NULL)
+    {
+        if ((*asid & ~ASID_MASK) != asid_generation)
+        {
+            *asid = asid_new();
+        }
+        id = *asid & ASID_MASK;
+    }
+    if (pgdir == active_pgdir && id == active_asid)
+    {
+        asid_stats.skipped++;
+    }
+    else
+    {
+        write_csr(satp, ((uint64_t)SATP_MODE_SV39 << 60) | (id << SATP64_ASID_SHIFT) |
+                            (pgdir >> PGSHIFT));
+        active_pgdir = pgdir, active_asid = id;
+        asid_stats.switches++;
+    }
+    if (asid_generation != generation)
+    {
+        flush_tlb();
+    }
+}
+
+// tlb_by_asid - whether TLB entries for @pgdir can be flushed by ASID: only
+// the loaded address space can, others may still have entries cached under
+// theirs, and kernel mappings are cached under every ASID
+static inline bool tlb_by_asid(pde_t *pgdir)
+{
+    return PADDR(pgdir) == active_pgdir && active_asid != ASID_KERNEL;
+}
+
 // invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
 void tlb_invalidate(pde_t *pgdir, uintptr_t la)
 {
-    // flush_tlb();
-    // The flush_tlb flush the entire TLB, is there any better way?
-    asm volatile("sfence.vma %0" : : "r"(la));
+    if (tlb_by_asid(pgdir))
+    {
+        asm volatile("sfence.vma %0, %1" : : "r"(la), "r"(active_asid) : "memory");
+    }
+    else
+    {
+        asm volatile("sfence.vma %0" : : "r"(la));
+    }
+}
+
+/* *
+ * mmu_gather - batched TLB invalidation for unmapping. Instead of a fence
+ * and a free_page per cleared PTE, the addresses and the pages to free are
+ * gathered, and tlb_flush_mmu invalidates them all at once before it frees
+ * the pages (a page must not be reused while a stale TLB entry still points
+ * to it):
+ *   - up to TLB_GATHER_ADDRS addresses are invalidated one by one, with the
+ *     light-weight sinval.vma between a single sfence.w.inval/sfence.inval.ir
+ *     pair when the hart has Svinval (and there is more than one), else with
+ *     one sfence.vma each;
+ *   - past that, or once a page table is gathered (non-leaf entries are only
+ *     dropped by a fence without an address), the TLB is flushed whole, for
+ *     the address space's ASID only when it is loaded.
+ * The gathered pages are then freed with free_pages_bulk.
+ * */
+
+#define SFENCE_W_INVAL()    asm volatile(".word 0x18000073" : : : "memory")
+#define SFENCE_INVAL_IR()   asm volatile(".word 0x18100073" : : : "memory")
+// sinval.vma rs1, rs2: la in that ASID only, global entries stay
+#define SINVAL_VMA(la, asid) \
+    asm volatile(".insn r 0x73, 0, 0x0b, x0, %0, %1" : : "r"(la), "r"(asid) : "memory")
+// sinval.vma rs1, x0: la in every ASID, global entries too
+#define SINVAL_VMA_ALL(la) \
+    asm volatile(".insn r 0x73, 0, 0x0b, x0, %0, x0" : : "r"(la) : "memory")
+
+// tlb_gather_mmu - start gathering the unmaps done on @pgdir
+void tlb_gather_mmu(struct mmu_gather *tlb, pde_t *pgdir)
+{
+    tlb->pgdir = pgdir;
+    tlb->flush_all = 0;
+    tlb->nr_addrs = tlb->nr_pages = 0;
 }
 
+// tlb_flush_mmu - invalidate everything gathered so far, then free the pages
+static void tlb_flush_mmu(struct mmu_gather *tlb)
+{
+    bool by_asid = tlb_by_asid(tlb->pgdir);
+    size_t i, n = 0;
+    if (tlb->flush_all)
+    {
+        if (by_asid)
+        {
+            asm volatile("sfence.vma zero, %0" : : "r"(active_asid) : "memory");
+        }
+        else
+        {
+            flush_tlb();
+        }
+    }
+    else if (has_svinval && tlb->nr_addrs > 1)
+    {
+        SFENCE_W_INVAL(); // the PTE stores before the invalidations
+        for (i = 0; i < tlb->nr_addrs; i++)
+        {
+            if (by_asid)
+            {
+                SINVAL_VMA(tlb->addrs[i], active_asid);
+            }
+            else
+            {
+                SINVAL_VMA_ALL(tlb->addrs[i]);
+            }
+        }
+        SFENCE_INVAL_IR(); // the invalidations before any later walk
+    }
+    else
+    {
+        for (i = 0; i < tlb->nr_addrs; i++)
+        {
+            tlb_invalidate(tlb->pgdir, tlb->addrs[i]);
+        }
+    }
+
+    // single pages go back in one bulk call, megapage/gigapage blocks one by one
+    for (i = 0; i < tlb->nr_pages; i++)
+    {
+        if (tlb->levels[i] == PGLEVEL_4K)
+        {
+            tlb->pages[n++] = tlb->pages[i];
+        }
+        else
+        {
+            free_pages(tlb->pages[i], PGLEVEL_SIZE(tlb->levels[i]) / PGSIZE);
+        }
+    }
+    free_pages_bulk(tlb->pages, n);
+    tlb->flush_all = 0;
+    tlb->nr_addrs = tlb->nr_pages = 0;
+}
+
+// tlb_gather_page - queue @page (the block a leaf at @level maps) to be freed
+// after the next flush
+static void tlb_gather_page(struct mmu_gather *tlb, struct Page *page,
+                            int level)
+{
+    if (tlb->nr_pages == TLB_GATHER_PAGES)
+    {
+        tlb_flush_mmu(tlb);
+    }
+    tlb->pages[tlb->nr_pages] = page;
+    tlb->levels[tlb->nr_pages++] = level;
+}
+
+// tlb_remove_page - the leaf at @level mapping la has been cleared or changed;
+// @page, if not NULL, is the block it mapped, to be freed once that is flushed
+void tlb_remove_page(struct mmu_gather *tlb, uintptr_t la, int level,
+                     struct Page *page)
+{
+    if (tlb->nr_addrs < TLB_GATHER_ADDRS)
+    {
+        tlb->addrs[tlb->nr_addrs++] = la;
+    }
+    else
+    {
+        tlb->flush_all = 1;
+    }
+    if (page != NULL)
+    {
+        tlb_gather_page(tlb, page, level);
+    }
+}
+
+// tlb_remove_table - the page table @page has been unlinked from the tree
+void tlb_remove_table(struct mmu_gather *tlb, struct Page *page)
+{
+    tlb_gather_page(tlb, page, PGLEVEL_4K);
+    tlb->flush_all = 1;
+}
+
+// tlb_finish_mmu - flush and free whatever is still gathered
+void tlb_finish_mmu(struct mmu_gather *tlb)
+{
+    if (tlb->flush_all || tlb->nr_addrs > 0 || tlb->nr_pages > 0)
+    {
+        tlb_flush_mmu(tlb);
+    }
+}
+
+/* *
+ * The kernel half - every address space maps the kernel the way boot_pgdir
+ * does. Rather than a copy of the kernel page tables, a new page directory
+ * gets a copy of the few valid root entries in the kernel half of boot_pgdir
+ * (KERNEL_PDX1 and up), and so shares the page tables below them: kernel
+ * mappings made under an existing root entry show up everywhere at once, and
+ * those tables are never reclaimed.
+ *
+ * A change to a kernel-half root entry of boot_pgdir bumps kernel_pgdir_gen.
+ * Each page directory remembers the generation it copied (mm_struct's
+ * kernel_gen), and pgdir_sync_kernel brings it up to date before it is
+ * switched to; only the one in satp at the time is updated right away.
+ * */
+static uint64_t kernel_pgdir_gen = 1;
+
+// kernel_pgdir_changed - *ptep, a kernel-half root entry of boot_pgdir, was
+// @old before
+static void kernel_pgdir_changed(pte_t *ptep, pte_t old)
+{
+    kernel_pgdir_gen++;
+    if (active_pgdir != boot_pgdir_pa)
+    {
+        pde_t *pgdir = KADDR(active_pgdir);
+        pgdir_sync_kernel(pgdir, NULL);
+    }
+    if (old & PTE_V)
+    {
+        // any address space may have cached what it mapped
+        flush_tlb();
+    }
+}
+
+// pgdir_sync_kernel - make the kernel half of @pgdir that of boot_pgdir again,
+// unless *kgen says it already is; @kgen may be NULL to sync regardless
+void pgdir_sync_kernel(pde_t *pgdir, uint64_t *kgen)
+{
+    if (kgen != NULL && *kgen == kernel_pgdir_gen)
+    {
+        return;
+    }
+    for (int i = KERNEL_PDX1; i < NPTEENTRY; i++)
+    {
+        if (pgdir[i] == boot_pgdir_va[i])
+        {
+            continue;
+        }
+        if (boot_pgdir_va[i] & PTE_V)
+        {
+            pte_install(&pgdir[i], boot_pgdir_va[i]);
+        }
+        else
+        {
+            pte_clear(&pgdir[i]);
+        }
+    }
+    if (kgen != NULL)
+    {
+        *kgen = kernel_pgdir_gen;
+    }
+}
+
+// pgdir_create - alloc the page directory of a new address space: one cleared
+// page, the kernel half filled in from boot_pgdir as of the generation it
+// stores in *kgen
+// return value: its kernel virtual address, or NULL if out of memory
+pde_t *pgdir_create(uint64_t *kgen)
+{
+    struct Page *page = alloc_zeroed_page();
+    if (page == NULL)
+    {
+        return NULL;
+    }
+    set_page_ref(page, 1);
+    page->pt_entries = 0;
+    pde_t *pgdir = page2kva(page);
+    for (int i = KERNEL_PDX1; i < NPTEENTRY; i++)
+    {
+        if (boot_pgdir_va[i] & PTE_V)
+        {
+            pte_install(&pgdir[i], boot_pgdir_va[i]);
+        }
+    }
+    *kgen = kernel_pgdir_gen;
+    return pgdir;
+}
+
+// pgdir_destroy - free a page directory from pgdir_create together with
+// whatever is still mapped in its user half. proc_run leaves satp alone for
+// kernel threads, so the last user of an address space may still have it
+// loaded: satp is moved to boot_pgdir first, and the user mappings are then
+// flushed under every ASID as for any address space that is not loaded.
+void pgdir_destroy(pde_t *pgdir)
+{
+    struct mmu_gather tlb;
+    bool intr_flag;
+    local_intr_save(intr_flag);
+    {
+        if (PADDR(pgdir) == active_pgdir)
+        {
+            switch_pgdir(boot_pgdir_pa, NULL);
+        }
+    }
+    local_intr_restore(intr_flag);
+    tlb_gather_mmu(&tlb, pgdir);
+    for (int i = 0; i < KERNEL_PDX1; i++)
+    {
+        uintptr_t la = (uintptr_t)i * PDSIZE;
+        if ((pgdir[i] & PTE_V) && !PTE_LEAF(pgdir[i]))
+        {
+            page_remove_table(&tlb, la, &pgdir[i], PGLEVEL_1G);
+        }
+        else
+        {
+            page_remove_pte(&tlb, la, &pgdir[i], PGLEVEL_1G);
+        }
+    }
+    tlb_finish_mmu(&tlb);
+    free_page(kva2page(pgdir));
+}
+
+#ifdef PGDIR_BENCH
+#define BENCH_PGDIRS        64
+
+// pgdir_bench - time creating and destroying a page directory, as a copy of
+// the whole boot_pgdir page and with pgdir_create. Build with
+// DEFS=-DPGDIR_BENCH to enable.
+static void pgdir_bench(void)
+{
+    pde_t *pgdirs[BENCH_PGDIRS];
+    uint64_t kgen, start, t[4];
+    int i;
+
+    start = rdtime();
+    for (i = 0; i < BENCH_PGDIRS; i++)
+    {
+        struct Page *page = alloc_page();
+        assert(page != NULL);
+        pgdirs[i] = page2kva(page);
+        memcpy(pgdirs[i], boot_pgdir_va, PGSIZE);
+    }
+    t[0] = rdtime() - start, start = rdtime();
+    for (i = 0; i < BENCH_PGDIRS; i++)
+    {
+        free_page(kva2page(pgdirs[i]));
+    }
+    t[1] = rdtime() - start;
+
+    zero_pool_refill();
+    start = rdtime();
+    for (i = 0; i < BENCH_PGDIRS; i++)
+    {
+        assert((pgdirs[i] = pgdir_create(&kgen)) != NULL);
+    }
+    t[2] = rdtime() - start, start = rdtime();
+    for (i = 0; i < BENCH_PGDIRS; i++)
+    {
+        pgdir_destroy(pgdirs[i]);
+    }
+    t[3] = rdtime() - start;
+
+    cprintf("pgdir_bench: ticks per page directory, create / destroy\n");
+    cprintf("  copy of boot_pgdir  %6d / %6d\n", (int)(t[0] / BENCH_PGDIRS),
+            (int)(t[1] / BENCH_PGDIRS));
+    cprintf("  pgdir_create        %6d / %6d\n", (int)(t[2] / BENCH_PGDIRS),
+            (int)(t[3] / BENCH_PGDIRS));
+}
+#endif /* PGDIR_BENCH */
+
 static void check_alloc_page(void)
 {
     pmm_manager->check();
     cprintf("check_alloc_page() succeeded!\n");
 }
 
+// check_pcp - single pages must come from and go back to the per-CPU cache,
+// with the manager only touched in PCP_BATCH steps
+static void check_pcp(void)
+{
+    struct pcp_cache *pcp = this_cpu_pcp();
+    size_t nr_free_store = nr_free_pages();
+    size_t manager_free = pmm_manager->nr_free_pages();
+    struct Page *p[PCP_HIGH + PCP_BATCH + 1];
+    int i;
+
+    assert(pcp->count == 0);
+    assert((p[0] = alloc_page()) != NULL);
+    assert(pcp->count == PCP_BATCH - 1);
+    assert(pmm_manager->nr_free_pages() == manager_free - PCP_BATCH);
+    assert(nr_free_pages() == nr_free_store - 1);
+    for (i = 1; i < PCP_BATCH; i++)
+    {
+        assert((p[i] = alloc_page()) != NULL);
+    }
+    assert(pcp->count == 0);
+    assert(pmm_manager->nr_free_pages() == manager_free - PCP_BATCH);
+
+    // the last page freed is the first one handed out again
+    free_page(p[0]);
+    assert(pcp->count == 1 && alloc_page() == p[0]);
+
+    for (; i < PCP_HIGH + PCP_BATCH + 1; i++)
+    {
+        assert((p[i] = alloc_page()) != NULL);
+    }
+    for (i = 0; i < PCP_HIGH + PCP_BATCH + 1; i++)
+    {
+        free_page(p[i]);
+        assert(pcp->count <= PCP_HIGH);
+    }
+    assert(nr_free_pages() == nr_free_store);
+
+    // a bulk request empties the cache first and takes the rest from the manager
+    size_t cached = pcp->count;
+    assert(alloc_pages_bulk(PCP_HIGH + PCP_BATCH + 1, p) == PCP_HIGH + PCP_BATCH + 1);
+    assert(pcp->count == 0);
+    assert(pmm_manager->nr_free_pages() == nr_free_store - (PCP_HIGH + PCP_BATCH + 1 - cached));
+    for (i = 0; i < PCP_HIGH + PCP_BATCH + 1; i++)
+    {
+        for (int j = i + 1; j < PCP_HIGH + PCP_BATCH + 1; j++)
+        {
+            assert(p[i] != p[j]);
+        }
+    }
+    free_pages_bulk(p, PCP_HIGH + PCP_BATCH + 1);
+    assert(pcp->count == PCP_HIGH);
+    assert(nr_free_pages() == nr_free_store);
+
+    pcp_drain(pcp, pcp->count);
+    assert(pmm_manager->nr_free_pages() == nr_free_store);
+
+    cprintf("check_pcp() succeeded!\n");
+}
+
+// check_numa - the per-node counters add up, a node-local request lands on its
+// node and is counted as a hit there
+static void check_numa(void)
+{
+    size_t total = 0;
+    int nid;
+    for (nid = 0; nid < nr_numa_nodes; nid++)
+    {
+        const int *zonelist = numa_zonelist(nid);
+        assert(zonelist[0] == nid);
+        for (int i = 1; i < nr_numa_nodes; i++)
+        {
+            assert(dtb_numa_distance(nid, zonelist[i - 1]) <= dtb_numa_distance(nid, zonelist[i]));
+        }
+        total += nr_free_pages_node(nid);
+    }
+    assert(total == nr_free_pages());
+
+    for (nid = 0; nid < nr_numa_nodes; nid++)
+    {
+        size_t nr_free_store = nr_free_pages_node(nid);
+        size_t hit_store = numa_stats[nid].hit;
+        struct Page *p;
+        // a manager without alloc_pages_node cannot honour nid
+        if (nr_free_store < 64 || (pmm_manager->alloc_pages_node == NULL && nr_numa_nodes > 1))
+        {
+            continue;
+        }
+        assert((p = alloc_pages_node(nid, 2)) != NULL);
+        assert(page_to_nid(p) == nid && page_to_nid(p + 1) == nid);
+        assert(nr_free_pages_node(nid) == nr_free_store - 2);
+        assert(numa_stats[nid].hit == hit_store + 2);
+        free_pages(p, 2);
+        assert(nr_free_pages_node(nid) == nr_free_store);
+        cprintf("numa: node %d, %d free pages, distance %d\n", nid,
+                (int)nr_free_store, dtb_numa_distance(numa_node_id(), nid));
+    }
+    assert(total == nr_free_pages());
+
+    // a refill never pulls remote pages into the per-CPU cache
+    if (pmm_manager->nr_free_pages_node != NULL)
+    {
+        struct Page *p = alloc_page();
+        list_entry_t *le = &(this_cpu_pcp()->pages);
+        assert(p != NULL && page_to_nid(p) == numa_node_id());
+        while ((le = list_next(le)) != &(this_cpu_pcp()->pages))
+        {
+            assert(page_to_nid(le2page(le, page_link)) == numa_node_id());
+        }
+        free_page(p);
+    }
+    assert(total == nr_free_pages());
+
+    cprintf("check_numa() succeeded!\n");
+}
+
+// check_zero_pool - refilled pages are free memory, come back cleared, and the
+// pool never grows past ZERO_POOL_HIGH
+static void check_zero_pool(void)
+{
+    size_t nr_free_store = nr_free_pages();
+    size_t hit_store = zero_pool_hit, miss_store = zero_pool_miss;
+    struct Page *p;
+    int i;
+
+    assert(zero_pool.count == 0);
+    assert(zero_pool_refill() && zero_pool.count == 1);
+    assert(nr_free_pages() == nr_free_store);
+
+    // dirty a free page, the pool must not hand it out as is
+    assert((p = alloc_page()) != NULL);
+    memset(page2kva(p), 0x5a, PGSIZE);
+    free_page(p);
+
+    for (i = 0; i < 2; i++)
+    {
+        assert((p = alloc_zeroed_page()) != NULL);
+        for (size_t off = 0; off < PGSIZE; off += sizeof(uint64_t))
+        {
+            assert(*(uint64_t *)((char *)page2kva(p) + off) == 0);
+        }
+        memset(page2kva(p), 0x5a, PGSIZE);
+        free_page(p);
+    }
+    assert(zero_pool_hit == hit_store + 1 && zero_pool_miss == miss_store + 1);
+    assert(zero_pool.count == 0);
+
+    while (zero_pool_refill())
+        ;
+    assert(zero_pool.count == ZERO_POOL_HIGH);
+    assert(nr_free_pages() == nr_free_store);
+
+    // draining hands every pooled page back to the manager
+    bool intr_flag;
+    local_intr_save(intr_flag);
+    zero_pool_drain();
+    local_intr_restore(intr_flag);
+    assert(nr_free_pages() == nr_free_store);
+
+    cprintf("check_zero_pool() succeeded!\n");
+}
+
 /*
     目的：check_pgdir() 是一个自测函数，专门用来验证你在 kern/mm/pmm.c 里实现的多级页表相关接口是否正确，尤其是：
         page_insert()（建立映射）
@@ -400,23 +2076,308 @@ static void check_pgdir(void)
     assert(page_ref(p1) == 1);
     assert(page_ref(p2) == 0);
 
+    assert(page_ref(pde2page(boot_pgdir_va[0])) == 1);
+
     page_remove(boot_pgdir_va, PGSIZE);
     assert(page_ref(p1) == 0);
     assert(page_ref(p2) == 0);
 
-    assert(page_ref(pde2page(boot_pgdir_va[0])) == 1);
-
-    pde_t *pd1 = boot_pgdir_va, *pd0 = page2kva(pde2page(boot_pgdir_va[0]));
-    free_page(pde2page(pd0[0]));
-    free_page(pde2page(pd1[0]));
-    boot_pgdir_va[0] = 0;
-    flush_tlb();
+    // the last mapping is gone, and with it both page tables under the root
+    assert(boot_pgdir_va[0] == 0);
 
     assert(nr_free_store == nr_free_pages());
 
     cprintf("check_pgdir() succeeded!\n");
 }
 
+// check_huge_pages - a megapage must take the place of the page table under
+// it, be found by get_pte for every address it covers, and be split when a
+// 4 KiB page inside it is mapped or unmapped; the boot page table already
+// maps the kernel with a gigapage
+static void check_huge_pages(void)
+{
+    size_t nr_free_store, nr = PTSIZE / PGSIZE;
+    uintptr_t la = PTSIZE;
+    pte_t *ptep;
+    int level;
+
+    nr_free_store = nr_free_pages();
+
+    ptep = get_pte_level(boot_pgdir_va, KERNBASE, PGLEVEL_4K, 0, &level);
+    assert(ptep == &boot_pgdir_va[PDX1(KERNBASE)] && level == PGLEVEL_1G);
+    assert(PTE_ADDR(*ptep) + KERNBASE % PDSIZE == PADDR(KERNBASE));
+
+    struct Page *huge = alloc_pages_aligned(nr), *p;
+    assert(huge != NULL && page2pa(huge) % PTSIZE == 0);
+
+    p = alloc_page();
+    assert(page_insert(boot_pgdir_va, p, la + PGSIZE, PTE_W | PTE_R) == 0);
+    assert(page_insert_huge(boot_pgdir_va, huge, la, PTE_W | PTE_R, PGLEVEL_2M) == 0);
+    assert(page_ref(huge) == 1 && page_ref(p) == 0);
+    for (size_t off = 0; off < PTSIZE; off += 97 * PGSIZE)
+    {
+        ptep = get_pte_level(boot_pgdir_va, la + off, PGLEVEL_4K, 0, &level);
+        assert(ptep == &((pte_t *)KADDR(PDE_ADDR(boot_pgdir_va[0])))[PDX0(la)]);
+        assert(level == PGLEVEL_2M && PTE_LEAF(*ptep));
+        assert(get_page(boot_pgdir_va, la + off, NULL) == huge);
+    }
+    *(uint64_t *)(la + PTSIZE - sizeof(uint64_t)) = 0x5a5a5a5a;
+    assert(*(uint64_t *)(page2kva(huge + nr) - sizeof(uint64_t)) == 0x5a5a5a5a);
+
+    // a 4 KiB page inside it splits the megapage, and only that page of the
+    // block is replaced; the others stay mapped, with a reference each
+    p = alloc_page();
+    assert(page_insert(boot_pgdir_va, p, la + PGSIZE, PTE_W | PTE_R) == 0);
+    assert(get_pte_level(boot_pgdir_va, la, PGLEVEL_4K, 0, &level) != NULL && level == PGLEVEL_4K);
+    assert(get_page(boot_pgdir_va, la, NULL) == huge && page_ref(huge) == 1);
+    assert(get_page(boot_pgdir_va, la + PGSIZE, NULL) == p && page_ref(p) == 1 && page_ref(huge + 1) == 0);
+    assert(get_page(boot_pgdir_va, la + 2 * PGSIZE, NULL) == huge + 2 && page_ref(huge + 2) == 1);
+
+    // so does page_remove of a page inside a new one, the rest stays mapped
+    assert(page_remove_range(boot_pgdir_va, la, nr) == 0 && boot_pgdir_va[0] == 0);
+    assert((huge = alloc_pages_aligned(nr)) != NULL);
+    assert(page_insert_huge(boot_pgdir_va, huge, la, PTE_W | PTE_R, PGLEVEL_2M) == 0);
+    assert(page_remove(boot_pgdir_va, la + 5 * PGSIZE) == 0);
+    assert(get_page(boot_pgdir_va, la + 5 * PGSIZE, NULL) == NULL && page_ref(huge + 5) == 0);
+    assert(get_page(boot_pgdir_va, la + 4 * PGSIZE, NULL) == huge + 4 && page_ref(huge + 4) == 1);
+    assert(get_page(boot_pgdir_va, la + PTSIZE - PGSIZE, NULL) == huge + nr - 1);
+    assert(page_remove_range(boot_pgdir_va, la, nr) == 0);
+    assert(get_pte(boot_pgdir_va, la, 0) == NULL && boot_pgdir_va[0] == 0);
+
+    // a range that covers part of a megapage splits it, and the rest stays
+    // mapped by pages with a reference each
+    assert((huge = alloc_pages_aligned(nr)) != NULL);
+    assert(page_insert_huge(boot_pgdir_va, huge, la, PTE_W | PTE_R, PGLEVEL_2M) == 0);
+    assert(page_remove_range(boot_pgdir_va, la + PTSIZE - 2 * PGSIZE, 4) == 0);
+    for (size_t i = 0; i < nr; i++)
+    {
+        ptep = get_pte_level(boot_pgdir_va, la + i * PGSIZE, PGLEVEL_4K, 0, &level);
+        assert(ptep != NULL && level == PGLEVEL_4K);
+        assert(get_page(boot_pgdir_va, la + i * PGSIZE, NULL) == ((i < nr - 2) ? huge + i : NULL));
+        assert(page_ref(huge + i) == (i < nr - 2));
+    }
+    assert(page_remove_range(boot_pgdir_va, la, nr) == 0);
+    assert(boot_pgdir_va[0] == 0);
+
+    assert(nr_free_store == nr_free_pages());
+
+    cprintf("check_huge_pages() succeeded!\n");
+}
+
+// check_asid - an address space keeps its ASID across switches until the
+// ASIDs run out, and switching to what is already loaded writes nothing;
+// boot_pgdir stands in for the address spaces' page tables
+static void check_asid(void)
+{
+    uint64_t a = 0, b = 0, c = 0, a_old;
+    struct asid_stat stats = asid_stats;
+
+    switch_pgdir(boot_pgdir_pa, NULL);
+    assert(asid_stats.skipped == stats.skipped + 1);
+
+    switch_pgdir(boot_pgdir_pa, &a);
+    assert((a & ~ASID_MASK) == asid_generation);
+    assert(((read_csr(satp) & SATP64_ASID) >> SATP64_ASID_SHIFT) == (a & ASID_MASK));
+    switch_pgdir(boot_pgdir_pa, &b);
+    assert(asid_bits == 0 || (a != b && (b & ASID_MASK) != ASID_KERNEL));
+    a_old = a;
+    switch_pgdir(boot_pgdir_pa, &a);
+    // a and b only fit in one generation with at least 2 bits
+    assert(asid_bits < 2 || a == a_old);
+    stats.skipped = asid_stats.skipped;
+    switch_pgdir(boot_pgdir_pa, &a);
+    assert(asid_stats.skipped == stats.skipped + 1);
+
+    // use up the rest of this generation
+    asid_next = 1UL << asid_bits;
+    stats.rollovers = asid_stats.rollovers;
+    switch_pgdir(boot_pgdir_pa, &c);
+    assert(asid_stats.rollovers == stats.rollovers + 1);
+    assert((c & ~ASID_MASK) == asid_generation && (a & ~ASID_MASK) != asid_generation);
+    switch_pgdir(boot_pgdir_pa, &a);
+    assert((a & ~ASID_MASK) == asid_generation);
+    assert(asid_bits < 2 || a != c);
+
+    switch_pgdir(boot_pgdir_pa, NULL);
+    assert((read_csr(satp) & SATP64_ASID) == 0);
+
+    cprintf("check_asid() succeeded!\n");
+}
+
+// check_mmu_gather - unmapped pages stay allocated until the gather is
+// flushed; a whole page table goes in TLB_GATHER_PAGES batches behind a
+// single full flush
+static void check_mmu_gather(void)
+{
+    size_t nr_free_store, nr_free_mapped, i;
+    struct mmu_gather tlb;
+    struct Page *p[3];
+    uintptr_t la = PTSIZE;
+    pte_t *ptep;
+
+    nr_free_store = nr_free_pages();
+
+    for (i = 0; i < 3; i++)
+    {
+        assert((p[i] = alloc_page()) != NULL);
+        assert(page_insert(boot_pgdir_va, p[i], la + i * PGSIZE, PTE_W | PTE_R) == 0);
+    }
+    nr_free_mapped = nr_free_pages();
+    tlb_gather_mmu(&tlb, boot_pgdir_va);
+    for (i = 0; i < 3; i++)
+    {
+        assert((ptep = get_pte(boot_pgdir_va, la + i * PGSIZE, 0)) != NULL);
+        page_remove_pte(&tlb, la + i * PGSIZE, ptep, PGLEVEL_4K);
+        assert(*ptep == 0 && page_ref(p[i]) == 0);
+    }
+    assert(tlb.nr_addrs == 3 && tlb.nr_pages == 3 && !tlb.flush_all);
+    assert(nr_free_pages() == nr_free_mapped);
+    tlb_finish_mmu(&tlb);
+    assert(tlb.nr_pages == 0 && nr_free_pages() == nr_free_mapped + 3);
+
+    for (i = 0; i < NPTEENTRY; i++)
+    {
+        struct Page *page = alloc_page();
+        assert(page != NULL);
+        assert(page_insert(boot_pgdir_va, page, la + i * PGSIZE, PTE_W | PTE_R) == 0);
+    }
+    pde_t *pdep0 = &((pde_t *)KADDR(PDE_ADDR(boot_pgdir_va[0])))[PDX0(la)];
+    tlb_gather_mmu(&tlb, boot_pgdir_va);
+    page_remove_table(&tlb, la, pdep0, PGLEVEL_2M);
+    assert(*pdep0 == 0 && tlb.flush_all);
+    assert(tlb.nr_pages == (NPTEENTRY + 1) % TLB_GATHER_PAGES);
+    pt_reclaim(&tlb, boot_pgdir_va, la, pdep0);
+    assert(boot_pgdir_va[0] == 0);
+    tlb_finish_mmu(&tlb);
+
+    assert(nr_free_store == nr_free_pages());
+
+    cprintf("check_mmu_gather() succeeded!\n");
+}
+
+// check_range - the range calls walk from the root once per leaf page table
+// they touch and do what page_insert/page_remove would have done page by page
+static void check_range(void)
+{
+    size_t nr_free_store, n = 300, walks, i;
+    uintptr_t la = PTSIZE - 100 * PGSIZE;
+    struct Page *page, **array;
+
+    nr_free_store = nr_free_pages();
+
+    assert((page = alloc_page()) != NULL);
+    array = page2kva(page);
+    assert(alloc_pages_bulk(n, array) == n);
+
+    // 100 pages below the 2 MiB boundary, 200 above it
+    walks = nr_pte_walks;
+    assert(page_insert_range(boot_pgdir_va, array, la, n, PTE_W | PTE_R) == 0);
+    assert(nr_pte_walks - walks == 2);
+    for (i = 0; i < n; i++)
+    {
+        assert(get_page(boot_pgdir_va, la + i * PGSIZE, NULL) == array[i]);
+        assert(page_ref(array[i]) == 1);
+    }
+    assert(page_insert_range(boot_pgdir_va, array, la, n, PTE_W | PTE_R) == 0);
+    assert(page_ref(array[0]) == 1 && page_ref(array[n - 1]) == 1);
+
+    // plus a walk for each page table left empty
+    walks = nr_pte_walks;
+    page_remove_range(boot_pgdir_va, la - 3 * PGSIZE, n + 3);
+    assert(nr_pte_walks - walks == 2 + 2);
+    assert(boot_pgdir_va[0] == 0);
+    for (i = 0; i < n; i++)
+    {
+        assert(get_page(boot_pgdir_va, la + i * PGSIZE, NULL) == NULL);
+        assert(page_ref(array[i]) == 0);
+    }
+
+    // nothing is mapped from 1 GiB on: one walk finds that out
+    walks = nr_pte_walks;
+    page_remove_range(boot_pgdir_va, PDSIZE, 3 * NPTEENTRY);
+    assert(nr_pte_walks - walks == 1);
+
+    free_page(page);
+
+    assert(nr_free_store == nr_free_pages());
+
+    cprintf("check_range() succeeded!\n");
+}
+
+// check_pgdir_share - a new page directory maps the kernel through the page
+// tables of boot_pgdir, sees kernel mappings added under them at once and a
+// new kernel root entry after pgdir_sync_kernel, or right away while in satp
+static void check_pgdir_share(void)
+{
+    size_t nr_free_store;
+    uintptr_t la = KERNBASE - PDSIZE, la2 = la - PDSIZE;
+    struct Page *p1, *p2, *table;
+    uint64_t kgen, asid = 0;
+    pde_t *pgdir;
+    int i;
+
+    nr_free_store = nr_free_pages();
+
+    assert((pgdir = pgdir_create(&kgen)) != NULL);
+    assert(nr_free_pages() == nr_free_store - 1);
+    for (i = 0; i < NPTEENTRY; i++)
+    {
+        assert(pgdir[i] == ((i < KERNEL_PDX1) ? 0 : boot_pgdir_va[i]));
+    }
+    assert(get_page(pgdir, KERNBASE, NULL) == get_page(boot_pgdir_va, KERNBASE, NULL));
+
+    // a kernel mapping in a gigabyte the kernel did not use: a new root entry
+    assert(PDX1(la) >= KERNEL_PDX1 && boot_pgdir_va[PDX1(la)] == 0);
+    assert((p1 = alloc_page()) != NULL);
+    assert(page_insert(boot_pgdir_va, p1, la, PTE_W | PTE_R) == 0);
+    assert(kgen != kernel_pgdir_gen && get_page(pgdir, la, NULL) == NULL);
+    pgdir_sync_kernel(pgdir, &kgen);
+    assert(kgen == kernel_pgdir_gen && get_page(pgdir, la, NULL) == p1);
+
+    // one under the same root entry needs no sync
+    assert((p2 = alloc_page()) != NULL);
+    assert(page_insert(boot_pgdir_va, p2, la + PTSIZE, PTE_W | PTE_R) == 0);
+    assert(kgen == kernel_pgdir_gen && get_page(pgdir, la + PTSIZE, NULL) == p2);
+
+    // user mappings stay in pgdir, and go with it
+    assert(page_insert(pgdir, p2, 0, PTE_U | PTE_W | PTE_R) == 0);
+    assert(page_ref(p2) == 2 && get_page(boot_pgdir_va, 0, NULL) == NULL);
+
+    switch_pgdir(PADDR(pgdir), &asid);
+    assert(page_insert(boot_pgdir_va, p1, la2, PTE_W | PTE_R) == 0);
+    assert(kgen != kernel_pgdir_gen && pgdir[PDX1(la2)] == boot_pgdir_va[PDX1(la2)]);
+    assert(*(uint64_t *)la2 == *(uint64_t *)la);
+    page_remove(boot_pgdir_va, la2);
+    switch_pgdir(boot_pgdir_pa, NULL);
+    pgdir_sync_kernel(pgdir, &kgen);
+
+    page_remove(boot_pgdir_va, la);
+    page_remove(boot_pgdir_va, la + PTSIZE);
+    assert(page_ref(p1) == 0 && page_ref(p2) == 1);
+    assert(kgen == kernel_pgdir_gen && (boot_pgdir_va[PDX1(la)] & PTE_V));
+
+    // the shared tables under the root entries stay until taken down by hand
+    for (i = PDX1(la2); i <= PDX1(la); i++)
+    {
+        table = pde2page(boot_pgdir_va[i]);
+        assert(table->pt_entries == 0);
+        pte_clear(&boot_pgdir_va[i]);
+        free_page(table);
+    }
+    pgdir_sync_kernel(pgdir, &kgen);
+    assert(pgdir[PDX1(la)] == 0 && pgdir[PDX1(la2)] == 0);
+
+    // destroyed while still in satp, as a kernel thread leaves it
+    switch_pgdir(PADDR(pgdir), &asid);
+    pgdir_destroy(pgdir);
+    assert(active_pgdir == boot_pgdir_pa && active_asid == ASID_KERNEL);
+    assert(page_ref(p2) == 0);
+
+    assert(nr_free_store == nr_free_pages());
+
+    cprintf("check_pgdir_share() succeeded!\n");
+}
+
 static void check_boot_pgdir(void)
 {
     size_t nr_free_store;
@@ -447,12 +2408,9 @@ static void check_boot_pgdir(void)
     *(char *)(page2kva(p) + 0x100) = '\0';
     assert(strlen((const char *)0x100) == 0);
 
-    pde_t *pd1 = boot_pgdir_va, *pd0 = page2kva(pde2page(boot_pgdir_va[0]));
-    free_page(p);
-    free_page(pde2page(pd0[0]));
-    free_page(pde2page(pd1[0]));
-    boot_pgdir_va[0] = 0;
-    flush_tlb();
+    page_remove(boot_pgdir_va, 0x100);
+    page_remove(boot_pgdir_va, 0x100 + PGSIZE);
+    assert(page_ref(p) == 0 && boot_pgdir_va[0] == 0);
 
     assert(nr_free_store == nr_free_pages());
 
@@ -27,6 +27,12 @@ struct pmm_manager
     void (*free_pages)(struct Page *base, size_t n);  // free >=n pages with "base" addr of Page descriptor structures(memlayout.h)
     size_t (*nr_free_pages)(void);                    // return the number of free pages
     void (*check)(void);                              // check the correctness of XXX_pmm_manager
+    size_t (*alloc_pages_bulk)(size_t n, struct Page **array); // optional: allocate n single pages (not contiguous) into array in
+                                                               // one pass, return the number allocated
+    void (*free_pages_bulk)(struct Page **array, size_t n);    // optional: free the n single pages in array in one pass
+    struct Page *(*alloc_pages_node)(int nid, size_t n);       // optional: allocate n pages from node nid, falling back along
+                                                               // numa_zonelist(nid); alloc_pages prefers numa_node_id()
+    size_t (*nr_free_pages_node)(int nid);                     // optional: return the number of free pages on node nid
 };
 
 extern const struct pmm_manager *pmm_manager;
@@ -39,16 +45,66 @@ void pmm_init(void);
 struct Page *alloc_pages(size_t n);
 void free_pages(struct Page *base, size_t n);
 size_t nr_free_pages(void);
+size_t alloc_pages_bulk(size_t n, struct Page **array);
+void free_pages_bulk(struct Page **array, size_t n);
+struct Page *alloc_pages_node(int nid, size_t n);
+struct Page *alloc_pages_aligned(size_t n);
+struct Page *alloc_zeroed_page(void);
+size_t alloc_zeroed_pages_bulk(size_t n, struct Page **array);
+bool zero_pool_refill(void);
+size_t nr_free_pages_node(int nid);
+
+extern int nr_numa_nodes;
+int numa_node_id(void);
+const int *numa_zonelist(int nid);
 
 #define alloc_page() alloc_pages(1)
 #define free_page(page) free_pages(page, 1)
 
 pte_t *get_pte(pde_t *pgdir, uintptr_t la, bool create);
+pte_t *get_pte_level(pde_t *pgdir, uintptr_t la, int level, bool create,
+                     int *level_store);
 struct Page *get_page(pde_t *pgdir, uintptr_t la, pte_t **ptep_store);
-void page_remove(pde_t *pgdir, uintptr_t la);
+int page_remove(pde_t *pgdir, uintptr_t la);
 int page_insert(pde_t *pgdir, struct Page *page, uintptr_t la, uint32_t perm);
+int page_insert_huge(pde_t *pgdir, struct Page *page, uintptr_t la,
+                     uint32_t perm, int level);
+int page_insert_range(pde_t *pgdir, struct Page **array, uintptr_t la,
+                      size_t n, uint32_t perm);
+int page_remove_range(pde_t *pgdir, uintptr_t la, size_t n);
+int page_split(pde_t *pgdir, uintptr_t la);
+int copy_range(pde_t *to, pde_t *from, uintptr_t start, uintptr_t end,
+               bool share);
 
 void tlb_invalidate(pde_t *pgdir, uintptr_t la);
+
+#define ASID_KERNEL 0 // the ASID boot_pgdir is loaded with, never given to an address space
+void switch_pgdir(uintptr_t pgdir, uint64_t *asid);
+
+pde_t *pgdir_create(uint64_t *kgen);
+void pgdir_destroy(pde_t *pgdir);
+void pgdir_sync_kernel(pde_t *pgdir, uint64_t *kgen);
+
+// mmu_gather collects the TLB entries and pages an unmap clears, so they are
+// flushed together and the pages freed in one batch, see tlb_flush_mmu
+#define TLB_GATHER_ADDRS 64 // addresses flushed one by one, past that the whole TLB
+#define TLB_GATHER_PAGES 64 // pages (or huge blocks) freed per batch
+
+struct mmu_gather
+{
+    pde_t *pgdir;                             // the page table being unmapped from
+    bool flush_all;                           // too many addresses, or a page table went away
+    size_t nr_addrs, nr_pages;
+    uintptr_t addrs[TLB_GATHER_ADDRS];        // linear addresses whose leaf was cleared
+    struct Page *pages[TLB_GATHER_PAGES];     // pages to free once the TLB is flushed
+    uint8_t levels[TLB_GATHER_PAGES];         // and the level they were mapped at
+};
+
+void tlb_gather_mmu(struct mmu_gather *tlb, pde_t *pgdir);
+void tlb_remove_page(struct mmu_gather *tlb, uintptr_t la, int level,
+                     struct Page *page);
+void tlb_remove_table(struct mmu_gather *tlb, struct Page *page);
+void tlb_finish_mmu(struct mmu_gather *tlb);
 struct Page *pgdir_alloc_page(pde_t *pgdir, uintptr_t la, uint32_t perm);
 
 void print_pgdir(void);
@@ -137,6 +193,12 @@ pde2page(pde_t pde)
     return pa2page(PDE_ADDR(pde));
 }
 
+static inline int
+page_to_nid(struct Page *page)
+{
+    return page->nid;
+}
+
 static inline int
 page_ref(struct Page *page)
 {
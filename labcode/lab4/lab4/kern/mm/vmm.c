@@ -8,6 +8,7 @@
 #include <pmm.h>
 #include <riscv.h>
 #include <kmalloc.h>
+#include <proc.h>
 
 /*
   vmm design include two parts: mm_struct (mm) & vma_struct (vma)
@@ -19,20 +20,36 @@
    golbal functions
      struct mm_struct * mm_create(void)
      void mm_destroy(struct mm_struct *mm)
+     int dup_mmap(struct mm_struct *to, struct mm_struct *from)
      int do_pgfault(struct mm_struct *mm, uint32_t error_code, uintptr_t addr)
 --------------
   vma related functions:
    global functions
      struct vma_struct * vma_create (uintptr_t vm_start, uintptr_t vm_end,...)
-     void insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma)
+     struct vma_struct * insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma)
      struct vma_struct * find_vma(struct mm_struct *mm, uintptr_t addr)
+     int vma_split(struct vma_struct *vma, uintptr_t addr)
+     int mm_mprotect(struct mm_struct *mm, uintptr_t addr, size_t len, uint32_t vm_flags)
+     int mm_unmap(struct mm_struct *mm, uintptr_t addr, size_t len)
    local functions
      inline void check_vma_overlap(struct vma_struct *prev, struct vma_struct *next)
+     inline bool vma_mergeable(struct vma_struct *prev, struct vma_struct *next)
+     inline uint32_t vma_perm(uint32_t vm_flags)
+     inline uint32_t vma_pte_perm(uint32_t vm_flags, pte_t pte)
+     int mm_split_huge(struct mm_struct *mm, uintptr_t addr)
+     int do_anon_fault(struct mm_struct *mm, struct vma_struct *vma, uintptr_t addr, pte_t *ptep, bool zero)
+     int do_huge_fault(struct mm_struct *mm, struct vma_struct *vma, uintptr_t addr)
+     int do_wp_page(struct mm_struct *mm, struct vma_struct *vma, uintptr_t addr, pte_t *ptep)
 ---------------
    check correctness functions
      void check_vmm(void);
      void check_vma_struct(void);
+     void check_vmacache(void);
+     void check_vma_merge(void);
      void check_pgfault(void);
+     void check_cow(void);
+     void check_zero_page(void);
+     void check_thp(void);
 */
 
 // szx func : print_vma and print_mm
@@ -60,7 +77,73 @@ void print_mm(char *name, struct mm_struct *mm)
 
 static void check_vmm(void);
 static void check_vma_struct(void);
+static void check_vmacache(void);
+static void check_vma_merge(void);
 static void check_pgfault(void);
+static void check_cow(void);
+static void check_zero_page(void);
+static void check_thp(void);
+#ifdef FORK_BENCH
+static void fork_bench(void);
+#endif
+#ifdef THP_BENCH
+static void thp_bench(void);
+#endif
+
+// page faults seen by do_pgfault, and the mm they are resolved in when there
+// is no current process to take it from (check_pgfault)
+volatile unsigned int pgfault_num = 0;
+struct mm_struct *check_mm_struct = NULL;
+
+// the page a read fault on anonymous memory maps, read-only, until the first
+// write (do_wp_page); the reference vmm_init holds keeps it shared for good
+static struct Page *zero_page;
+
+// whether do_pgfault maps megapages, see THP_ENABLED
+static bool thp_enabled = THP_ENABLED;
+
+// an mm indexes its vma in mmap_tree as well once it has this many of them;
+// below that, walking mmap_list costs no more than the tree
+#define RB_MIN_MAP_COUNT        32
+
+/* *
+ * vmacache - find_vma first looks through the few vma the current thread
+ * found last in the same mm (proc_struct.vmacache), beginning with the slot
+ * the page number of addr hashes to, where a new find goes too. A thread going
+ * back and forth between its code, heap and stack keeps all of them there.
+ *
+ * mm->vmacache_seqnum takes a new value from vmacache_seq whenever the vma
+ * of the mm change, and a cache is emptied the first time it is used after
+ * that. The numbers are unique across all mm, so a thread moving to another
+ * mm never mistakes its old entries for new ones.
+ * */
+static uint64_t vmacache_seq;
+struct vmacache_stat vmacache_stats;
+
+// vmacache_invalidate - the vma of mm have changed
+static inline void
+vmacache_invalidate(struct mm_struct *mm)
+{
+    mm->vmacache_seqnum = ++vmacache_seq;
+}
+
+// vmacache_current - the vmacache of the current thread if it runs in mm,
+// emptied first if it is from before the last change to the vma of mm
+static struct vmacache *
+vmacache_current(struct mm_struct *mm)
+{
+    if (current == NULL || current->mm != mm)
+    {
+        return NULL;
+    }
+    struct vmacache *cache = &(current->vmacache);
+    if (cache->seqnum != mm->vmacache_seqnum)
+    {
+        cache->seqnum = mm->vmacache_seqnum;
+        memset(cache->vmas, 0, sizeof(cache->vmas));
+    }
+    return cache;
+}
 
 // mm_create -  alloc a mm_struct & initialize it.
 struct mm_struct *
@@ -71,9 +154,14 @@ mm_create(void)
     if (mm != NULL)
     {
         list_init(&(mm->mmap_list));
-        mm->mmap_cache = NULL;
+        rb_root_init(&(mm->mmap_tree));
+        vmacache_invalidate(mm);
         mm->pgdir = NULL;
+        mm->asid = 0;
+        mm->kernel_gen = 0;
         mm->map_count = 0;
+        set_mm_count(mm, 0);
+        memset(&(mm->fault_stat), 0, sizeof(struct mm_fault_stat));
         mm->sm_priv = NULL;
     }
     return mm;
@@ -94,6 +182,31 @@ vma_create(uintptr_t vm_start, uintptr_t vm_end, uint32_t vm_flags)
     return vma;
 }
 
+// find_vma_rb - find the vma containing addr in mm->mmap_tree; the vma do
+// not overlap, so at most one can
+static struct vma_struct *
+find_vma_rb(struct mm_struct *mm, uintptr_t addr)
+{
+    rb_node_t *node = mm->mmap_tree.node;
+    while (node != NULL)
+    {
+        struct vma_struct *vma = rb2vma(node, rb_link);
+        if (addr < vma->vm_start)
+        {
+            node = node->left;
+        }
+        else if (addr >= vma->vm_end)
+        {
+            node = node->right;
+        }
+        else
+        {
+            return vma;
+        }
+    }
+    return NULL;
+}
+
 // find_vma - find a vma  (vma->vm_start <= addr <= vma_vm_end)
 struct vma_struct *
 find_vma(struct mm_struct *mm, uintptr_t addr)
@@ -101,8 +214,25 @@ find_vma(struct mm_struct *mm, uintptr_t addr)
     struct vma_struct *vma = NULL;
     if (mm != NULL)
     {
-        vma = mm->mmap_cache;
-        if (!(vma != NULL && vma->vm_start <= addr && vma->vm_end > addr))
+        struct vmacache *cache = vmacache_current(mm);
+        if (cache != NULL)
+        {
+            for (int i = 0; i < VMACACHE_SIZE; i++)
+            {
+                vma = cache->vmas[(VMACACHE_HASH(addr) + i) % VMACACHE_SIZE];
+                if (vma != NULL && vma->vm_start <= addr && addr < vma->vm_end)
+                {
+                    vmacache_stats.hits++;
+                    return vma;
+                }
+            }
+            vmacache_stats.misses++;
+        }
+        if (!rb_empty(&(mm->mmap_tree)))
+        {
+            vma = find_vma_rb(mm, addr);
+        }
+        else
         {
             bool found = 0;
             list_entry_t *list = &(mm->mmap_list), *le = list;
@@ -120,9 +250,9 @@ find_vma(struct mm_struct *mm, uintptr_t addr)
                 vma = NULL;
             }
         }
-        if (vma != NULL)
+        if (vma != NULL && cache != NULL)
         {
-            mm->mmap_cache = vma;
+            cache->vmas[VMACACHE_HASH(addr)] = vma;
         }
     }
     return vma;
@@ -137,22 +267,129 @@ check_vma_overlap(struct vma_struct *prev, struct vma_struct *next)
     assert(next->vm_start < next->vm_end);
 }
 
-// insert_vma_struct -insert vma in mm's list link
-void insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma)
+// vma_tree_find - find where a vma starting at vm_start goes in mm's rb-tree,
+// after any vma with the same start: the empty link and its parent
+// return value: the vma just before it, or NULL if it comes first
+static struct vma_struct *
+vma_tree_find(struct mm_struct *mm, uintptr_t vm_start,
+              rb_node_t ***link_store, rb_node_t **parent_store)
+{
+    rb_node_t **link = &(mm->mmap_tree.node), *parent = NULL;
+    struct vma_struct *prev = NULL;
+    while (*link != NULL)
+    {
+        parent = *link;
+        if (vm_start < rb2vma(parent, rb_link)->vm_start)
+        {
+            link = &(parent->left);
+        }
+        else
+        {
+            prev = rb2vma(parent, rb_link);
+            link = &(parent->right);
+        }
+    }
+    *link_store = link;
+    *parent_store = parent;
+    return prev;
+}
+
+// vma_tree_link - put vma in mm's rb-tree, after any vma with the same start
+// return value: the vma just before it, or NULL if it comes first
+static struct vma_struct *
+vma_tree_link(struct mm_struct *mm, struct vma_struct *vma)
+{
+    rb_node_t **link, *parent;
+    struct vma_struct *prev = vma_tree_find(mm, vma->vm_start, &link, &parent);
+    rb_link_node(&(vma->rb_link), parent, link);
+    rb_insert_color(&(vma->rb_link), &(mm->mmap_tree));
+    return prev;
+}
+
+// vma_mergeable - can next be folded into prev: they touch and have the same flags
+static inline bool
+vma_mergeable(struct vma_struct *prev, struct vma_struct *next)
+{
+    return prev->vm_end == next->vm_start && prev->vm_flags == next->vm_flags;
+}
+
+// vma_unlink - take vma off mm's list and rb-tree, the caller frees it
+static void
+vma_unlink(struct mm_struct *mm, struct vma_struct *vma)
+{
+    list_del(&(vma->list_link));
+    if (!rb_empty(&(mm->mmap_tree)))
+    {
+        rb_erase(&(vma->rb_link), &(mm->mmap_tree));
+    }
+    mm->map_count--;
+    vmacache_invalidate(mm);
+}
+
+// vma_merge_next - fold the vma after vma into it if they are mergeable
+// return value: 1 if it did
+static bool
+vma_merge_next(struct mm_struct *mm, struct vma_struct *vma)
+{
+    list_entry_t *le_next = list_next(&(vma->list_link));
+    if (le_next != &(mm->mmap_list))
+    {
+        struct vma_struct *next = le2vma(le_next, list_link);
+        if (vma_mergeable(vma, next))
+        {
+            vma->vm_end = next->vm_end;
+            vma_unlink(mm, next);
+            kfree(next);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// vma_tree_build - index every vma on mm's list in its rb-tree
+static void
+vma_tree_build(struct mm_struct *mm)
+{
+    list_entry_t *list = &(mm->mmap_list), *le = list;
+    while ((le = list_next(le)) != list)
+    {
+        vma_tree_link(mm, le2vma(le, list_link));
+    }
+}
+
+// insert_vma_struct -insert vma in mm's list link, and in its rb-tree if it
+// has one; the tree is built once map_count reaches RB_MIN_MAP_COUNT
+//                   - a vma it touches with the same vm_flags on either side
+//                     takes vma's range instead and vma is freed
+// return value: the vma that now covers vma's range
+struct vma_struct *
+insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma)
 {
     assert(vma->vm_start < vma->vm_end);
     list_entry_t *list = &(mm->mmap_list);
     list_entry_t *le_prev = list, *le_next;
+    rb_node_t **link = NULL, *parent = NULL;
 
-    list_entry_t *le = list;
-    while ((le = list_next(le)) != list)
+    if (!rb_empty(&(mm->mmap_tree)))
     {
-        struct vma_struct *mmap_prev = le2vma(le, list_link);
-        if (mmap_prev->vm_start > vma->vm_start)
+        struct vma_struct *mmap_prev = vma_tree_find(mm, vma->vm_start, &link, &parent);
+        if (mmap_prev != NULL)
         {
-            break;
+            le_prev = &(mmap_prev->list_link);
+        }
+    }
+    else
+    {
+        list_entry_t *le = list;
+        while ((le = list_next(le)) != list)
+        {
+            struct vma_struct *mmap_prev = le2vma(le, list_link);
+            if (mmap_prev->vm_start > vma->vm_start)
+            {
+                break;
+            }
+            le_prev = le;
         }
-        le_prev = le;
     }
 
     le_next = list_next(le_prev);
@@ -167,10 +404,277 @@ void insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma)
         check_vma_overlap(vma, le2vma(le_next, list_link));
     }
 
+    vmacache_invalidate(mm);
+
+    /* merge with the neighbours, neither moves in the list or the tree */
+    if (le_prev != list && vma_mergeable(le2vma(le_prev, list_link), vma))
+    {
+        struct vma_struct *prev = le2vma(le_prev, list_link);
+        prev->vm_end = vma->vm_end;
+        vma_merge_next(mm, prev);
+        kfree(vma);
+        return prev;
+    }
+    if (le_next != list && vma_mergeable(vma, le2vma(le_next, list_link)))
+    {
+        struct vma_struct *next = le2vma(le_next, list_link);
+        next->vm_start = vma->vm_start;
+        kfree(vma);
+        return next;
+    }
+
     vma->vm_mm = mm;
     list_add_after(le_prev, &(vma->list_link));
+    if (link != NULL)
+    {
+        rb_link_node(&(vma->rb_link), parent, link);
+        rb_insert_color(&(vma->rb_link), &(mm->mmap_tree));
+    }
+
+    mm->map_count++;
+    if (rb_empty(&(mm->mmap_tree)) && mm->map_count >= RB_MIN_MAP_COUNT)
+    {
+        vma_tree_build(mm);
+    }
+    return vma;
+}
 
+// vma_split - cut vma in two at addr, vma keeps [vm_start, addr) and a new vma
+//             right after it gets [addr, vm_end) with the same vm_flags
+// return value: 0 or -E_NO_MEM
+int vma_split(struct vma_struct *vma, uintptr_t addr)
+{
+    struct mm_struct *mm = vma->vm_mm;
+    assert(vma->vm_start < addr && addr < vma->vm_end);
+    struct vma_struct *tail = vma_create(addr, vma->vm_end, vma->vm_flags);
+    if (tail == NULL)
+    {
+        return -E_NO_MEM;
+    }
+    tail->vm_mm = mm;
+    vma->vm_end = addr;
+    list_add_after(&(vma->list_link), &(tail->list_link));
+    if (!rb_empty(&(mm->mmap_tree)))
+    {
+        vma_tree_link(mm, tail);
+    }
     mm->map_count++;
+    vmacache_invalidate(mm);
+    return 0;
+}
+
+// vma_perm - the pte permissions of the pages of a vma with vm_flags
+static inline uint32_t
+vma_perm(uint32_t vm_flags)
+{
+    uint32_t perm = PTE_U;
+    if (vm_flags & VM_READ)
+    {
+        perm |= PTE_R;
+    }
+    if (vm_flags & VM_WRITE)
+    {
+        perm |= (PTE_R | PTE_W);
+    }
+    if (vm_flags & VM_EXEC)
+    {
+        perm |= PTE_X;
+    }
+    return perm;
+}
+
+// vma_pte_perm - vma_perm for the page pte maps, except that a page shared
+// copy-on-write (by more than one pte) stays read-only
+static inline uint32_t
+vma_pte_perm(uint32_t vm_flags, pte_t pte)
+{
+    uint32_t perm = vma_perm(vm_flags);
+    if ((perm & PTE_W) && page_ref(pte2page(pte)) > 1)
+    {
+        perm &= ~PTE_W;
+    }
+    return perm;
+}
+
+// mm_change_perm - give the pages mapped in [start, end) of mm the permissions
+// of vm_flags, one walk per leaf page table, a missing table skips what it
+// would have mapped; a megapage has to lie in the range whole (mm_split_huge)
+static void
+mm_change_perm(struct mm_struct *mm, uintptr_t start, uintptr_t end, uint32_t vm_flags)
+{
+    struct mmu_gather tlb;
+    uintptr_t la = start;
+    pte_t *ptep;
+    int lv;
+    tlb_gather_mmu(&tlb, mm->pgdir);
+    while (la < end)
+    {
+        ptep = get_pte_level(mm->pgdir, la, PGLEVEL_4K, 0, &lv);
+        if (ptep == NULL)
+        {
+            la = ROUNDDOWN(la, PGLEVEL_SIZE(lv)) + PGLEVEL_SIZE(lv);
+            continue;
+        }
+        assert(la % PGLEVEL_SIZE(lv) == 0 && end - la >= PGLEVEL_SIZE(lv));
+        do
+        {
+            if ((*ptep & PTE_V) && (*ptep & PTE_USER & ~PTE_V) != vma_pte_perm(vm_flags, *ptep))
+            {
+                *ptep = (*ptep & ~(PTE_USER & ~PTE_V)) | vma_pte_perm(vm_flags, *ptep);
+                tlb_remove_page(&tlb, la, lv, NULL);
+            }
+            la += PGLEVEL_SIZE(lv), ptep++;
+        } while (lv == PGLEVEL_4K && la < end && PTX(la) != 0);
+    }
+    tlb_finish_mmu(&tlb);
+}
+
+// mm_split_huge - split the megapage (or gigapage) addr is inside of, unless
+// addr is where it starts, so that what changes from addr on leaves the part
+// before addr as it is
+// return value: 0 or -E_NO_MEM
+static int
+mm_split_huge(struct mm_struct *mm, uintptr_t addr)
+{
+    pte_t *ptep;
+    int lv, ret;
+    while ((ptep = get_pte_level(mm->pgdir, addr, PGLEVEL_4K, 0, &lv)) != NULL &&
+           lv > PGLEVEL_4K && addr % PGLEVEL_SIZE(lv) != 0)
+    {
+        if ((ret = page_split(mm->pgdir, addr)) != 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// mm_mprotect - give [addr, addr + len), rounded out to pages, vm_flags
+//             - the range has to be mapped all through; vma are split only
+//               at its two ends, and the vma it ends up in are merged with
+//               their neighbours wherever the flags now agree
+//             - the pages already mapped there get the new permissions, a
+//               megapage across either end is split into pages first
+// return value: 0, -E_INVAL if part of the range is not mapped, or -E_NO_MEM
+int mm_mprotect(struct mm_struct *mm, uintptr_t addr, size_t len, uint32_t vm_flags)
+{
+    uintptr_t start = ROUNDDOWN(addr, PGSIZE), end = ROUNDUP(addr + len, PGSIZE);
+    if (start >= end)
+    {
+        return -E_INVAL;
+    }
+
+    /* the whole range is covered, without holes */
+    struct vma_struct *vma = find_vma(mm, start), *first = vma;
+    if (vma == NULL)
+    {
+        return -E_INVAL;
+    }
+    while (vma->vm_end < end)
+    {
+        list_entry_t *le_next = list_next(&(vma->list_link));
+        if (le_next == &(mm->mmap_list) || le2vma(le_next, list_link)->vm_start != vma->vm_end)
+        {
+            return -E_INVAL;
+        }
+        vma = le2vma(le_next, list_link);
+    }
+
+    /* split the megapages across the ends before anything changes */
+    int ret;
+    if (mm->pgdir != NULL &&
+        ((ret = mm_split_huge(mm, start)) != 0 || (ret = mm_split_huge(mm, end)) != 0))
+    {
+        return ret;
+    }
+
+    /* split where the range ends inside a vma whose flags change */
+    if (vma->vm_flags != vm_flags && vma->vm_end > end)
+    {
+        if ((ret = vma_split(vma, end)) != 0)
+        {
+            return ret;
+        }
+    }
+    vma = first;
+    if (vma->vm_flags != vm_flags && vma->vm_start < start)
+    {
+        if ((ret = vma_split(vma, start)) != 0)
+        {
+            return ret;
+        }
+        vma = le2vma(list_next(&(vma->list_link)), list_link);
+    }
+
+    /* set the flags, then merge from the vma before the range to the one after */
+    list_entry_t *list = &(mm->mmap_list), *le = &(vma->list_link);
+    list_entry_t *le_prev = list_prev(le);
+    while (le != list && le2vma(le, list_link)->vm_start < end)
+    {
+        le2vma(le, list_link)->vm_flags = vm_flags;
+        le = list_next(le);
+    }
+    le = (le_prev != list) ? le_prev : list_next(le_prev);
+    while (le != list && (vma = le2vma(le, list_link))->vm_start < end)
+    {
+        if (!vma_merge_next(mm, vma))
+        {
+            le = list_next(le);
+        }
+    }
+    if (mm->pgdir != NULL)
+    {
+        mm_change_perm(mm, start, end, vm_flags);
+    }
+    return 0;
+}
+
+// mm_unmap - unmap [addr, addr + len), rounded out to pages: the vma there are
+//            cut back or dropped, holes in the range are skipped
+//          - the pages mapped there are removed, a megapage only partly in
+//            the range is split into pages first (page_remove_range)
+// return value: 0, -E_INVAL for an empty range, or -E_NO_MEM
+int mm_unmap(struct mm_struct *mm, uintptr_t addr, size_t len)
+{
+    uintptr_t start = ROUNDDOWN(addr, PGSIZE), end = ROUNDUP(addr + len, PGSIZE);
+    int ret;
+    if (start >= end)
+    {
+        return -E_INVAL;
+    }
+    if (mm->pgdir != NULL &&
+        (ret = page_remove_range(mm->pgdir, start, (end - start) / PGSIZE)) != 0)
+    {
+        return ret;
+    }
+
+    list_entry_t *list = &(mm->mmap_list), *le = list_next(list);
+    while (le != list && le2vma(le, list_link)->vm_start < end)
+    {
+        struct vma_struct *vma = le2vma(le, list_link);
+        le = list_next(le);
+        if (vma->vm_end <= start)
+        {
+            continue;
+        }
+        if (vma->vm_start < start)
+        {
+            /* keep the part before the range, the rest comes next */
+            if ((ret = vma_split(vma, start)) != 0)
+            {
+                return ret;
+            }
+            le = list_next(&(vma->list_link));
+            continue;
+        }
+        if (vma->vm_end > end && (ret = vma_split(vma, end)) != 0)
+        {
+            return ret;
+        }
+        vma_unlink(mm, vma);
+        kfree(vma);
+    }
+    return 0;
 }
 
 // mm_destroy - free mm and mm internal fields
@@ -187,10 +691,272 @@ void mm_destroy(struct mm_struct *mm)
     mm = NULL;
 }
 
+// do_anon_fault - map a cleared page at the unmapped page addr of vma, whose
+// pte is at ptep; for a VM_READ|VM_WRITE vma also at the other unmapped pages
+// of the FAULT_AROUND_PAGES window around it, as far as pages can be had
+//  - zero: a read, map zero_page read-only instead, which takes no memory
+// return value: 0 or -E_NO_MEM
+static int
+do_anon_fault(struct mm_struct *mm, struct vma_struct *vma, uintptr_t addr, pte_t *ptep,
+              bool zero)
+{
+    struct Page *pages[FAULT_AROUND_PAGES];
+    uint32_t perm = vma_perm(vma->vm_flags);
+    uintptr_t start = addr, end = addr + PGSIZE, la;
+    size_t need = 1, got, i;
+
+    /* the window lies in one page table, (FAULT_AROUND_PAGES * PGSIZE) divides 2M */
+    if ((vma->vm_flags & (VM_READ | VM_WRITE)) == (VM_READ | VM_WRITE))
+    {
+        start = ROUNDDOWN(addr, FAULT_AROUND_PAGES * PGSIZE);
+        end = start + FAULT_AROUND_PAGES * PGSIZE;
+        if (start < ROUNDDOWN(vma->vm_start, PGSIZE))
+        {
+            start = ROUNDDOWN(vma->vm_start, PGSIZE);
+        }
+        if (end > ROUNDUP(vma->vm_end, PGSIZE))
+        {
+            end = ROUNDUP(vma->vm_end, PGSIZE);
+        }
+        ptep -= (addr - start) / PGSIZE;
+        for (need = 0, la = start; la < end; la += PGSIZE)
+        {
+            need += !(ptep[(la - start) / PGSIZE] & PTE_V);
+        }
+    }
+    if (zero)
+    {
+        for (i = 0; i < need; i++)
+        {
+            pages[i] = zero_page;
+        }
+        perm &= ~PTE_W;
+        mm->fault_stat.zero_maps += need;
+    }
+    else if ((got = alloc_zeroed_pages_bulk(need, pages)) < need)
+    {
+        /* short of memory, just the page itself */
+        free_pages_bulk(pages, got);
+        ptep += (addr - start) / PGSIZE;
+        start = addr, end = addr + PGSIZE, need = 1;
+        if (alloc_zeroed_pages_bulk(1, pages) < 1)
+        {
+            return -E_NO_MEM;
+        }
+    }
+
+    /* one page_insert_range per run of unmapped ptes */
+    for (i = 0, la = start; la < end;)
+    {
+        size_t n = 0;
+        while (la + n * PGSIZE < end && !(ptep[(la - start) / PGSIZE + n] & PTE_V))
+        {
+            n++;
+        }
+        if (n > 0)
+        {
+            int ret = page_insert_range(mm->pgdir, pages + i, la, n, perm);
+            assert(ret == 0); // the page table is there already
+            i += n;
+        }
+        la += (n + 1) * PGSIZE;
+    }
+    assert(i == need);
+    mm->fault_stat.around += need - 1;
+    return 0;
+}
+
+// do_huge_fault - map the aligned 2 MiB around the unmapped address addr with
+// one cleared megapage, if vma covers all of it, nothing there is mapped yet
+// (not even a page table for it) and an aligned block of pages can be had
+// return value: 0, or -E_NO_MEM if it did not (pages will do then)
+static int
+do_huge_fault(struct mm_struct *mm, struct vma_struct *vma, uintptr_t addr)
+{
+    uintptr_t start = ROUNDDOWN(addr, PTSIZE);
+    struct Page *page;
+    pte_t *pdep;
+    int lv;
+    if (!thp_enabled || start < vma->vm_start || start + PTSIZE > vma->vm_end)
+    {
+        return -E_NO_MEM;
+    }
+    pdep = get_pte_level(mm->pgdir, start, PGLEVEL_2M, 1, &lv);
+    if (pdep == NULL || lv != PGLEVEL_2M || (*pdep & PTE_V))
+    {
+        return -E_NO_MEM;
+    }
+    if ((page = alloc_pages_aligned(PTSIZE / PGSIZE)) == NULL)
+    {
+        mm->fault_stat.thp_fallbacks++;
+        return -E_NO_MEM;
+    }
+    memset(page2kva(page), 0, PTSIZE);
+    int ret = page_insert_huge(mm->pgdir, page, start, vma_perm(vma->vm_flags) | PTE_A | PTE_D,
+                               PGLEVEL_2M);
+    assert(ret == 0); // the page table is there already
+    mm->fault_stat.thp_faults++;
+    return 0;
+}
+
+// do_wp_page - a write to the read-only page addr of vma, whose pte is at
+// ptep, and the vma allows it: the page is shared copy-on-write, so the
+// writer gets a copy of its own, or the page itself once nobody else maps it;
+// for zero_page the copy is just a cleared page
+// return value: 0 or -E_NO_MEM
+static int
+do_wp_page(struct mm_struct *mm, struct vma_struct *vma, uintptr_t addr, pte_t *ptep)
+{
+    struct Page *page = pte2page(*ptep), *npage;
+    uint32_t perm = vma_perm(vma->vm_flags);
+    if (page_ref(page) == 1)
+    {
+        *ptep = (*ptep & ~(PTE_USER & ~PTE_V)) | perm | PTE_A | PTE_D;
+        tlb_invalidate(mm->pgdir, addr);
+        mm->fault_stat.cow_reuses++;
+        return 0;
+    }
+    if ((npage = (page == zero_page) ? alloc_zeroed_page() : alloc_page()) == NULL)
+    {
+        return -E_NO_MEM;
+    }
+    if (page != zero_page)
+    {
+        memcpy(page2kva(npage), page2kva(page), PGSIZE);
+    }
+    // drops the shared page's reference and the stale TLB entry
+    int ret = page_insert(mm->pgdir, npage, addr, perm | PTE_A | PTE_D);
+    assert(ret == 0); // the page table is there already
+    mm->fault_stat.cow_copies++;
+    return 0;
+}
+
+// do_pgfault - interrupt handler to process the page fault execption
+// parameter:
+//  mm:         the control struct of the address space that faulted
+//  error_code: the cause of the fault, CAUSE_LOAD/STORE/FETCH_PAGE_FAULT
+//  addr:       the address that caused the fault
+// return value: 0, -E_INVAL if no vma of mm allows the access, or -E_NO_MEM
+int do_pgfault(struct mm_struct *mm, uint32_t error_code, uintptr_t addr)
+{
+    int ret = -E_INVAL;
+    struct vma_struct *vma = find_vma(mm, addr);
+
+    pgfault_num++;
+    if (vma == NULL)
+    {
+        cprintf("do_pgfault failed: no vma at addr %x\n", addr);
+        goto failed;
+    }
+    switch (error_code)
+    {
+    case CAUSE_STORE_PAGE_FAULT:
+        if (!(vma->vm_flags & VM_WRITE))
+        {
+            cprintf("do_pgfault failed: write to a vma without VM_WRITE, addr %x\n", addr);
+            goto failed;
+        }
+        break;
+    case CAUSE_FETCH_PAGE_FAULT:
+        if (!(vma->vm_flags & VM_EXEC))
+        {
+            cprintf("do_pgfault failed: fetch from a vma without VM_EXEC, addr %x\n", addr);
+            goto failed;
+        }
+        break;
+    default:
+        if (!(vma->vm_flags & (VM_READ | VM_WRITE)))
+        {
+            cprintf("do_pgfault failed: read from a vma without VM_READ, addr %x\n", addr);
+            goto failed;
+        }
+    }
+
+    addr = ROUNDDOWN(addr, PGSIZE);
+    ret = -E_NO_MEM;
+    int lv;
+    pte_t *ptep = get_pte_level(mm->pgdir, addr, PGLEVEL_4K, 0, &lv);
+    if (ptep == NULL || !(*ptep & PTE_V))
+    {
+        /* nothing mapped: a megapage, or pages (reads get zero_page) */
+        if (error_code != CAUSE_LOAD_PAGE_FAULT && do_huge_fault(mm, vma, addr) == 0)
+        {
+            goto done;
+        }
+        if ((ptep = get_pte(mm->pgdir, addr, 1)) == NULL ||
+            (ret = do_anon_fault(mm, vma, addr, ptep, error_code == CAUSE_LOAD_PAGE_FAULT)) != 0)
+        {
+            goto failed;
+        }
+    }
+    else if (error_code == CAUSE_STORE_PAGE_FAULT && !(*ptep & PTE_W))
+    {
+        // a megapage is never shared (copy_range splits it), so never copied
+        assert(lv == PGLEVEL_4K || page_ref(pte2page(*ptep)) == 1);
+        if ((ret = do_wp_page(mm, vma, addr, ptep)) != 0)
+        {
+            goto failed;
+        }
+    }
+    else
+    {
+        /* mapped meanwhile, a stale TLB entry, or a hart that leaves A/D to
+         * software: the vma allows the access, so the pte gets the vma's
+         * permissions, A (and D for a store) and the entry is dropped */
+        *ptep = (*ptep & ~(PTE_USER & ~PTE_V)) | vma_pte_perm(vma->vm_flags, *ptep) | PTE_A;
+        if (error_code == CAUSE_STORE_PAGE_FAULT)
+        {
+            *ptep |= PTE_D;
+        }
+        tlb_invalidate(mm->pgdir, addr);
+        mm->fault_stat.fixups++;
+    }
+done:
+    mm->fault_stat.faults++;
+    return 0;
+
+failed:
+    mm->fault_stat.errors += (ret == -E_INVAL);
+    return ret;
+}
+
+// dup_mmap - give to (a new mm, with its pgdir) a copy of every vma of from,
+// and the pages mapped there, shared copy-on-write with from
+// return value: 0 or -E_NO_MEM
+int dup_mmap(struct mm_struct *to, struct mm_struct *from)
+{
+    assert(to != NULL && from != NULL);
+    list_entry_t *list = &(from->mmap_list), *le = list;
+    while ((le = list_next(le)) != list)
+    {
+        struct vma_struct *vma, *nvma;
+        vma = le2vma(le, list_link);
+        nvma = vma_create(vma->vm_start, vma->vm_end, vma->vm_flags);
+        if (nvma == NULL)
+        {
+            return -E_NO_MEM;
+        }
+
+        insert_vma_struct(to, nvma);
+
+        if (copy_range(to->pgdir, from->pgdir, ROUNDDOWN(vma->vm_start, PGSIZE),
+                       ROUNDUP(vma->vm_end, PGSIZE), 1) != 0)
+        {
+            return -E_NO_MEM;
+        }
+    }
+    return 0;
+}
+
 // vmm_init - initialize virtual memory management
 //          - now just call check_vmm to check correctness of vmm
 void vmm_init(void)
 {
+    if ((zero_page = alloc_zeroed_page()) == NULL)
+    {
+        panic("vmm_init: no memory for zero_page.\n");
+    }
+    set_page_ref(zero_page, 1);
     check_vmm();
 }
 
@@ -199,7 +965,18 @@ static void
 check_vmm(void)
 {
     check_vma_struct();
-    // check_pgfault();
+    check_vmacache();
+    check_vma_merge();
+    check_pgfault();
+    check_cow();
+    check_zero_page();
+    check_thp();
+#ifdef FORK_BENCH
+    fork_bench();
+#endif
+#ifdef THP_BENCH
+    thp_bench();
+#endif
 
     cprintf("check_vmm() succeeded.\n");
 }
@@ -210,9 +987,12 @@ check_vma_struct(void)
     struct mm_struct *mm = mm_create();
     assert(mm != NULL);
 
-    int step1 = 10, step2 = step1 * 10;
+    // enough vma for find_vma and insert_vma_struct to go through mmap_tree
+    int step1 = 10, step2 = step1 * 200;
+    uint64_t start, t_insert, t_find;
 
     int i;
+    start = rdtime();
     for (i = step1; i >= 1; i--)
     {
         struct vma_struct *vma = vma_create(i * 5, i * 5 + 2, 0);
@@ -226,17 +1006,23 @@ check_vma_struct(void)
         assert(vma != NULL);
         insert_vma_struct(mm, vma);
     }
+    t_insert = rdtime() - start;
 
     list_entry_t *le = list_next(&(mm->mmap_list));
+    rb_node_t *node = rb_first(&(mm->mmap_tree));
 
     for (i = 1; i <= step2; i++)
     {
         assert(le != &(mm->mmap_list));
         struct vma_struct *mmap = le2vma(le, list_link);
         assert(mmap->vm_start == i * 5 && mmap->vm_end == i * 5 + 2);
+        assert(node != NULL && rb2vma(node, rb_link) == mmap);
         le = list_next(le);
+        node = rb_next(node);
     }
+    assert(node == NULL);
 
+    start = rdtime();
     for (i = 5; i <= 5 * step2; i += 5)
     {
         struct vma_struct *vma1 = find_vma(mm, i);
@@ -253,6 +1039,9 @@ check_vma_struct(void)
         assert(vma1->vm_start == i && vma1->vm_end == i + 2);
         assert(vma2->vm_start == i && vma2->vm_end == i + 2);
     }
+    t_find = rdtime() - start;
+    cprintf("check_vma_struct: %d vma, %d ticks per insert_vma_struct, %d per find_vma\n",
+            step2, (int)(t_insert / step2), (int)(t_find / (5 * step2)));
 
     for (i = 4; i >= 0; i--)
     {
@@ -267,4 +1056,593 @@ check_vma_struct(void)
     mm_destroy(mm);
 
     cprintf("check_vma_struct() succeeded!\n");
-}
\ No newline at end of file
+}
+
+// check_vmacache - a thread going back and forth between its code, heap and
+// stack finds them in its vmacache until insert_vma_struct changes the mm;
+// current is still NULL here, so proc stands in for the running thread
+static void
+check_vmacache(void)
+{
+    static struct proc_struct proc;
+    struct proc_struct *current_store = current;
+    struct vmacache_stat stats = vmacache_stats;
+
+    struct mm_struct *mm = mm_create();
+    assert(mm != NULL);
+
+    // pages 0x840, 0x1041, 0x7ffbe hash to different slots
+    uintptr_t addr[3] = {0x840000, 0x1041000, 0x7ffbe000};
+    insert_vma_struct(mm, vma_create(0x800000, 0x900000, VM_READ | VM_EXEC));
+    insert_vma_struct(mm, vma_create(0x1000000, 0x1100000, VM_READ | VM_WRITE));
+    insert_vma_struct(mm, vma_create(0x7ff00000, 0x80000000, VM_READ | VM_WRITE));
+
+    // only the threads of mm go through a vmacache
+    assert(find_vma(mm, addr[0]) != NULL);
+    assert(vmacache_stats.hits == stats.hits && vmacache_stats.misses == stats.misses);
+
+    memset(&proc, 0, sizeof(struct proc_struct));
+    proc.mm = mm;
+    current = &proc;
+
+    int i, j, round = 16;
+    for (i = 0; i < round; i++)
+    {
+        for (j = 0; j < 3; j++)
+        {
+            // stay on the same slot, within the vma
+            uintptr_t la = addr[j] - i * VMACACHE_SIZE * PGSIZE + 8;
+            struct vma_struct *vma = find_vma(mm, la);
+            assert(vma != NULL && vma->vm_start <= la && la < vma->vm_end);
+        }
+    }
+    // one miss for each vma, the first time
+    assert(vmacache_stats.misses - stats.misses == 3);
+    assert(vmacache_stats.hits - stats.hits == 3 * round - 3);
+
+    // a new vma drops everything found so far
+    insert_vma_struct(mm, vma_create(0x2000000, 0x2100000, VM_READ));
+    assert(find_vma(mm, addr[1]) != NULL);
+    assert(vmacache_stats.misses - stats.misses == 4);
+    assert(find_vma(mm, addr[1]) != NULL);
+    assert(vmacache_stats.hits - stats.hits == 3 * round - 2);
+
+    // a miss that finds nothing caches nothing
+    assert(find_vma(mm, 0x3000000) == NULL);
+    assert(find_vma(mm, 0x3000000) == NULL);
+    assert(vmacache_stats.misses - stats.misses == 6);
+
+    current = current_store;
+    mm_destroy(mm);
+
+    cprintf("check_vmacache: %d hits, %d misses\n",
+            (int)(vmacache_stats.hits - stats.hits), (int)(vmacache_stats.misses - stats.misses));
+    cprintf("check_vmacache() succeeded!\n");
+}
+
+// check_mm_vma - mm's vma are sorted, apart, and not mergeable, map_count
+// counts them and mmap_tree, if built, has them in the same order
+static void
+check_mm_vma(struct mm_struct *mm)
+{
+    list_entry_t *list = &(mm->mmap_list), *le = list;
+    rb_node_t *node = rb_first(&(mm->mmap_tree));
+    struct vma_struct *prev = NULL;
+    int count = 0;
+    while ((le = list_next(le)) != list)
+    {
+        struct vma_struct *vma = le2vma(le, list_link);
+        assert(vma->vm_mm == mm && vma->vm_start < vma->vm_end);
+        if (prev != NULL)
+        {
+            check_vma_overlap(prev, vma);
+            assert(!vma_mergeable(prev, vma));
+        }
+        if (!rb_empty(&(mm->mmap_tree)))
+        {
+            assert(node != NULL && rb2vma(node, rb_link) == vma);
+            node = rb_next(node);
+        }
+        prev = vma;
+        count++;
+    }
+    assert(node == NULL && count == mm->map_count);
+}
+
+// check_vma_merge - insert_vma_struct merges vma that touch and agree on
+// vm_flags, mm_mprotect splits them where the flags change and merges back
+static void
+check_vma_merge(void)
+{
+    struct mm_struct *mm = mm_create();
+    assert(mm != NULL);
+
+    // filling the hole between two vma leaves one
+    struct vma_struct *vma = insert_vma_struct(mm, vma_create(0x1000, 0x2000, VM_READ));
+    assert(insert_vma_struct(mm, vma_create(0x3000, 0x4000, VM_READ)) != vma);
+    assert(insert_vma_struct(mm, vma_create(0x2000, 0x3000, VM_READ)) == vma);
+    assert(mm->map_count == 1 && vma->vm_start == 0x1000 && vma->vm_end == 0x4000);
+    insert_vma_struct(mm, vma_create(0x4000, 0x5000, VM_READ | VM_WRITE));
+    assert(mm->map_count == 2);
+
+    // a heap grown one page at a time stays one vma, from both ends
+    int i, step = 100;
+    struct vma_struct *heap = insert_vma_struct(mm, vma_create(0x100000, 0x101000, VM_READ | VM_WRITE));
+    for (i = 1; i < step; i++)
+    {
+        assert(insert_vma_struct(mm, vma_create(0x100000 + i * PGSIZE, 0x101000 + i * PGSIZE,
+                                                VM_READ | VM_WRITE)) == heap);
+        assert(insert_vma_struct(mm, vma_create(0x100000 - i * PGSIZE, 0x101000 - i * PGSIZE,
+                                                VM_READ | VM_WRITE)) == heap);
+    }
+    assert(mm->map_count == 3 && heap->vm_start == 0x100000 - (step - 1) * PGSIZE);
+    check_mm_vma(mm);
+
+    // split in the middle, then the flags agree again and it merges back
+    assert(mm_mprotect(mm, 0x2000, PGSIZE, VM_READ | VM_WRITE) == 0);
+    assert(mm->map_count == 5);
+    check_mm_vma(mm);
+    assert(mm_mprotect(mm, 0x2800, 8, VM_READ) == 0);
+    assert(mm->map_count == 3 && find_vma(mm, 0x1000) == find_vma(mm, 0x3fff));
+    check_mm_vma(mm);
+
+    // the end of one vma joins the next one
+    assert(mm_mprotect(mm, 0x3000, PGSIZE, VM_READ | VM_WRITE) == 0);
+    assert(mm->map_count == 3);
+    vma = find_vma(mm, 0x3000);
+    assert(vma->vm_start == 0x3000 && vma->vm_end == 0x5000);
+    check_mm_vma(mm);
+
+    // across two vma, and across a hole
+    assert(mm_mprotect(mm, 0x1000, 4 * PGSIZE, VM_READ) == 0);
+    assert(mm->map_count == 2);
+    assert(mm_mprotect(mm, 0x4000, 2 * PGSIZE, VM_READ | VM_WRITE) == -E_INVAL);
+    assert(mm_mprotect(mm, 0x800, PGSIZE, VM_READ | VM_WRITE) == -E_INVAL);
+    assert(mm->map_count == 2 && find_vma(mm, 0x1000)->vm_end == 0x5000);
+    check_mm_vma(mm);
+    mm_destroy(mm);
+
+    // the same with the rb-tree: every other page, then the pages in between
+    mm = mm_create();
+    assert(mm != NULL);
+    for (i = 0; i < step; i++)
+    {
+        insert_vma_struct(mm, vma_create((2 * i) * PGSIZE, (2 * i + 1) * PGSIZE, VM_READ));
+    }
+    assert(mm->map_count == step && !rb_empty(&(mm->mmap_tree)));
+    for (i = 0; i < step / 2; i++)
+    {
+        assert(mm_mprotect(mm, (4 * i) * PGSIZE, PGSIZE, VM_READ | VM_EXEC) == 0);
+    }
+    assert(mm->map_count == step);
+    check_mm_vma(mm);
+    for (i = 0; i < step - 1; i++)
+    {
+        insert_vma_struct(mm, vma_create((2 * i + 1) * PGSIZE, (2 * i + 2) * PGSIZE, VM_READ));
+    }
+    check_mm_vma(mm);
+    assert(mm_mprotect(mm, 0, (2 * step - 1) * PGSIZE, VM_READ) == 0);
+    assert(mm->map_count == 1 && rb_first(&(mm->mmap_tree)) == &(find_vma(mm, 0)->rb_link));
+    check_mm_vma(mm);
+    mm_destroy(mm);
+
+    cprintf("check_vma_merge() succeeded!\n");
+}
+
+// check_pgfault - touching the vma of check_mm_struct, mapped in boot_pgdir,
+// faults and do_pgfault maps cleared pages there, a window at a time
+static void
+check_pgfault(void)
+{
+    size_t nr_free_pages_store = nr_free_pages();
+    unsigned int pgfault_num_store = pgfault_num;
+
+    check_mm_struct = mm_create();
+    assert(check_mm_struct != NULL);
+
+    struct mm_struct *mm = check_mm_struct;
+    pde_t *pgdir = mm->pgdir = boot_pgdir_va;
+    assert(pgdir[0] == 0);
+
+    // a page short of 2 MiB, so that it gets pages rather than a megapage
+    struct vma_struct *vma = insert_vma_struct(mm, vma_create(0, PTSIZE - PGSIZE, VM_READ | VM_WRITE));
+    insert_vma_struct(mm, vma_create(PTSIZE, PTSIZE + 4 * PGSIZE, VM_READ));
+    assert(mm->map_count == 2);
+
+    uintptr_t addr = 0x100;
+    assert(find_vma(mm, addr) == vma);
+
+    int i, sum = 0;
+    for (i = 0; i < 100; i++)
+    {
+        *(char *)(addr + i) = i;
+        sum += i;
+    }
+    for (i = 0; i < 100; i++)
+    {
+        sum -= *(char *)(addr + i);
+    }
+    assert(sum == 0);
+    assert(mm->fault_stat.faults == 1 && mm->fault_stat.around == FAULT_AROUND_PAGES - 1);
+
+    // a pass writing n pages faults once per window it touches, and finds them cleared
+    size_t window = FAULT_AROUND_PAGES * PGSIZE, n = 4 * FAULT_AROUND_PAGES + 3;
+    uintptr_t base = PTSIZE / 2 + 5 * PGSIZE;
+    size_t faults = (ROUNDUP(base + n * PGSIZE, window) - ROUNDDOWN(base, window)) / window;
+    for (i = 0; i < n; i++)
+    {
+        uint64_t *p = (uint64_t *)(base + i * PGSIZE);
+        p[0] = i;
+        assert(p[1] == 0 && p[PGSIZE / sizeof(uint64_t) - 1] == 0);
+    }
+    assert(mm->fault_stat.faults == 1 + faults);
+    assert(mm->fault_stat.around == faults * FAULT_AROUND_PAGES - faults + FAULT_AROUND_PAGES - 1);
+
+    // a read-only vma gets zero_page, one page per fault, and no store
+    assert(*(volatile char *)(PTSIZE + PGSIZE) == 0);
+    assert(mm->fault_stat.faults == 2 + faults && get_pte(pgdir, PTSIZE, 0) != NULL);
+    assert(!(*get_pte(pgdir, PTSIZE, 0) & PTE_V));
+    pte_t *ptep = get_pte(pgdir, PTSIZE + PGSIZE, 0);
+    assert((*ptep & PTE_V) && (*ptep & PTE_R) && !(*ptep & PTE_W));
+    assert(do_pgfault(mm, CAUSE_STORE_PAGE_FAULT, PTSIZE + PGSIZE) == -E_INVAL);
+    assert(mm->fault_stat.errors == 1);
+
+    // mm_mprotect takes write permission from the mapped ptes and gives it back
+    assert(mm_mprotect(mm, 0, PGSIZE, VM_READ) == 0 && mm->map_count == 3);
+    ptep = get_pte(pgdir, addr, 0);
+    assert((*ptep & PTE_R) && !(*ptep & PTE_W) && (*(get_pte(pgdir, addr + PGSIZE, 0)) & PTE_W));
+    assert(do_pgfault(mm, CAUSE_STORE_PAGE_FAULT, addr) == -E_INVAL);
+    assert(mm_mprotect(mm, 0, PGSIZE, VM_READ | VM_WRITE) == 0 && mm->map_count == 2);
+    assert(*ptep & PTE_W);
+    *(char *)addr = 1;
+
+    // a fault on a mapped page the vma allows only redoes its pte
+    assert(do_pgfault(mm, CAUSE_LOAD_PAGE_FAULT, addr) == 0);
+    assert(mm->fault_stat.fixups == 1 && *(char *)addr == 1);
+    assert(pgfault_num - pgfault_num_store == mm->fault_stat.faults + mm->fault_stat.errors);
+
+    cprintf("check_pgfault: %d faults for %d pages, %d by fault-around, %d fixups, %d errors\n",
+            (int)mm->fault_stat.faults, (int)(mm->fault_stat.faults - mm->fault_stat.fixups + mm->fault_stat.around),
+            (int)mm->fault_stat.around, (int)mm->fault_stat.fixups, (int)mm->fault_stat.errors);
+
+    page_remove_range(pgdir, 0, (PTSIZE + 4 * PGSIZE) / PGSIZE);
+    assert(pgdir[0] == 0);
+
+    mm->pgdir = NULL;
+    mm_destroy(mm);
+    check_mm_struct = NULL;
+
+    assert(nr_free_pages_store == nr_free_pages());
+
+    cprintf("check_pgfault() succeeded!\n");
+}
+
+// cow_mm_create - an mm with its own pgdir, and a VM_READ|VM_WRITE vma of n
+// pages at la, the first touched of them mapped through do_pgfault
+static struct mm_struct *
+cow_mm_create(uintptr_t la, size_t n, size_t touched)
+{
+    struct mm_struct *mm = mm_create();
+    assert(mm != NULL);
+    mm->pgdir = pgdir_create(&(mm->kernel_gen));
+    assert(mm->pgdir != NULL);
+    insert_vma_struct(mm, vma_create(la, la + n * PGSIZE, VM_READ | VM_WRITE));
+    for (size_t i = 0; i < touched; i++)
+    {
+        pte_t *ptep = get_pte(mm->pgdir, la + i * PGSIZE, 0);
+        if (ptep == NULL || !(*ptep & PTE_V))
+        {
+            assert(do_pgfault(mm, CAUSE_STORE_PAGE_FAULT, la + i * PGSIZE) == 0);
+        }
+    }
+    return mm;
+}
+
+// cow_mm_destroy - undo cow_mm_create, and dup_mmap
+static void
+cow_mm_destroy(struct mm_struct *mm)
+{
+    pgdir_destroy(mm->pgdir);
+    mm->pgdir = NULL;
+    mm_destroy(mm);
+}
+
+// check_cow - dup_mmap shares the parent's pages read-only, and the first
+// write on either side copies a page only while the other still maps it
+static void
+check_cow(void)
+{
+    size_t nr_free_pages_store = nr_free_pages();
+    uintptr_t la = 0x800000;
+    size_t n = 3 * FAULT_AROUND_PAGES, i;
+
+    struct mm_struct *parent = cow_mm_create(la, 2 * n, n);
+    for (i = 0; i < n; i++)
+    {
+        *(size_t *)page2kva(get_page(parent->pgdir, la + i * PGSIZE, NULL)) = i;
+    }
+
+    // the child gets two page tables, and no pages
+    struct mm_struct *child = mm_create();
+    assert(child != NULL);
+    child->pgdir = pgdir_create(&(child->kernel_gen));
+    assert(child->pgdir != NULL);
+    size_t nr_free_pages_fork = nr_free_pages();
+    assert(dup_mmap(child, parent) == 0 && child->map_count == parent->map_count);
+    assert(nr_free_pages_fork - nr_free_pages() == 2);
+
+    pte_t *ptep, *nptep;
+    for (i = 0; i < 2 * n; i++)
+    {
+        struct Page *page = get_page(parent->pgdir, la + i * PGSIZE, &ptep);
+        assert(get_page(child->pgdir, la + i * PGSIZE, &nptep) == page);
+        if (page != NULL)
+        {
+            assert(page_ref(page) == 2 && !(*ptep & PTE_W) && *nptep == *ptep);
+        }
+    }
+
+    // the child writes: a copy; then the parent: its page is its own again
+    assert(do_pgfault(child, CAUSE_STORE_PAGE_FAULT, la) == 0);
+    struct Page *page = get_page(parent->pgdir, la, &ptep), *npage = get_page(child->pgdir, la, &nptep);
+    assert(npage != page && page_ref(page) == 1 && page_ref(npage) == 1);
+    assert((*nptep & PTE_W) && !(*ptep & PTE_W) && *(size_t *)page2kva(npage) == 0);
+    assert(do_pgfault(parent, CAUSE_STORE_PAGE_FAULT, la) == 0);
+    assert(get_page(parent->pgdir, la, &ptep) == page && (*ptep & PTE_W));
+    assert(child->fault_stat.cow_copies == 1 && parent->fault_stat.cow_reuses == 1);
+
+    // a read, or mm_mprotect, leaves a shared page read-only
+    assert(do_pgfault(parent, CAUSE_LOAD_PAGE_FAULT, la + PGSIZE) == 0);
+    assert(mm_mprotect(parent, la + PGSIZE, PGSIZE, VM_READ | VM_WRITE) == 0);
+    assert(!(*get_pte(parent->pgdir, la + PGSIZE, 0) & PTE_W));
+
+    // the parent writes where the child never looks, and the child goes away
+    assert(do_pgfault(parent, CAUSE_STORE_PAGE_FAULT, la + 2 * PGSIZE) == 0);
+    assert(parent->fault_stat.cow_copies == 1);
+    assert(*(size_t *)page2kva(get_page(child->pgdir, la + 2 * PGSIZE, NULL)) == 2);
+    cow_mm_destroy(child);
+    for (i = 1; i < n; i++)
+    {
+        assert(page_ref(get_page(parent->pgdir, la + i * PGSIZE, NULL)) == 1);
+    }
+    assert(do_pgfault(parent, CAUSE_STORE_PAGE_FAULT, la + PGSIZE) == 0);
+    assert(parent->fault_stat.cow_copies == 1 && parent->fault_stat.cow_reuses == 2);
+
+    cow_mm_destroy(parent);
+    assert(nr_free_pages_store == nr_free_pages());
+
+    cprintf("check_cow() succeeded!\n");
+}
+
+#ifdef FORK_BENCH
+// fork_bench - dup_mmap of a parent with more and more memory mapped, against
+// copying the pages outright: ticks, and pages taken, per fork. Build with
+// DEFS=-DFORK_BENCH to enable.
+static void
+fork_bench(void)
+{
+    static const size_t sizes[] = {16, 256, 4096};
+    uintptr_t la = 0x10000000;
+    uint64_t start, t[2];
+    size_t used[2];
+    int i, share;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        struct mm_struct *parent = cow_mm_create(la, sizes[i], sizes[i]);
+        for (share = 1; share >= 0; share--)
+        {
+            size_t nr_free = nr_free_pages();
+            start = rdtime();
+            struct mm_struct *child = mm_create();
+            assert(child != NULL);
+            child->pgdir = pgdir_create(&(child->kernel_gen));
+            assert(child->pgdir != NULL);
+            if (share)
+            {
+                assert(dup_mmap(child, parent) == 0);
+            }
+            else
+            {
+                insert_vma_struct(child, vma_create(la, la + sizes[i] * PGSIZE, VM_READ | VM_WRITE));
+                assert(copy_range(child->pgdir, parent->pgdir, la, la + sizes[i] * PGSIZE, 0) == 0);
+            }
+            t[share] = rdtime() - start;
+            used[share] = nr_free - nr_free_pages();
+            cow_mm_destroy(child);
+        }
+        cprintf("fork_bench: %d pages: copy-on-write %d ticks, %d pages; copy %d ticks, %d pages\n",
+                (int)sizes[i], (int)t[1], (int)used[1], (int)t[0], (int)used[0]);
+        cow_mm_destroy(parent);
+    }
+}
+#endif
+
+// check_zero_page - reading a sparse buffer maps zero_page all over it, and
+// takes no memory but page tables; a write gets a cleared page of its own
+static void
+check_zero_page(void)
+{
+    size_t nr_free_pages_store = nr_free_pages();
+    uintptr_t la = 0x800000;
+    size_t n = PTSIZE / PGSIZE, i, zero_ref = page_ref(zero_page);
+
+    struct mm_struct *mm = cow_mm_create(la, n, 0);
+    size_t nr_free_pages_read = nr_free_pages();
+    for (i = 0; i < n; i += FAULT_AROUND_PAGES / 2)
+    {
+        pte_t *ptep = get_pte(mm->pgdir, la + i * PGSIZE, 0);
+        if (ptep == NULL || !(*ptep & PTE_V))
+        {
+            assert(do_pgfault(mm, CAUSE_LOAD_PAGE_FAULT, la + i * PGSIZE) == 0);
+        }
+    }
+    // one leaf page table, and the one above it
+    assert(nr_free_pages_read - nr_free_pages() == 2);
+    assert(mm->fault_stat.faults == n / FAULT_AROUND_PAGES && mm->fault_stat.zero_maps == n);
+    assert(page_ref(zero_page) == zero_ref + n);
+
+    pte_t *ptep;
+    for (i = 0; i < n; i++)
+    {
+        assert(get_page(mm->pgdir, la + i * PGSIZE, &ptep) == zero_page);
+        assert((*ptep & PTE_R) && !(*ptep & PTE_W));
+    }
+
+    // the first write: a cleared page, zero_page stays as it is
+    assert(do_pgfault(mm, CAUSE_STORE_PAGE_FAULT, la + 5 * PGSIZE) == 0);
+    struct Page *page = get_page(mm->pgdir, la + 5 * PGSIZE, &ptep);
+    assert(page != zero_page && page_ref(page) == 1 && (*ptep & PTE_W));
+    assert(page_ref(zero_page) == zero_ref + n - 1 && mm->fault_stat.cow_copies == 1);
+    for (i = 0; i < PGSIZE / sizeof(size_t); i++)
+    {
+        assert(((size_t *)page2kva(page))[i] == 0 && ((size_t *)page2kva(zero_page))[i] == 0);
+    }
+
+    // mm_mprotect leaves it read-only, and the teardown does not free it
+    assert(mm_mprotect(mm, la, n * PGSIZE, VM_READ | VM_WRITE) == 0);
+    assert(!(*get_pte(mm->pgdir, la, 0) & PTE_W));
+    cow_mm_destroy(mm);
+    assert(page_ref(zero_page) == zero_ref);
+    assert(nr_free_pages_store == nr_free_pages());
+
+    cprintf("check_zero_page() succeeded!\n");
+}
+
+// check_thp - a write into a vma that covers an aligned 2 MiB maps all of it
+// with one cleared megapage; mm_mprotect or mm_unmap of part of it, and
+// dup_mmap, split it into pages that keep what was written there
+static void
+check_thp(void)
+{
+    size_t nr_free_pages_store = nr_free_pages();
+    uintptr_t la = 0x800000, la2 = la + PTSIZE;
+    size_t nr = PTSIZE / PGSIZE, i;
+    struct Page *huge, *huge2, *page;
+    pte_t *ptep;
+    int lv;
+
+    // two megapages' worth, and a page on either side
+    struct mm_struct *mm = cow_mm_create(la - PGSIZE, 2 * nr + 2, 0);
+    assert(do_pgfault(mm, CAUSE_STORE_PAGE_FAULT, la - PGSIZE) == 0);
+    assert(do_pgfault(mm, CAUSE_STORE_PAGE_FAULT, la2 + PTSIZE) == 0);
+    assert(mm->fault_stat.thp_faults == 0);
+    assert(do_pgfault(mm, CAUSE_STORE_PAGE_FAULT, la + 7 * PGSIZE) == 0);
+    assert(do_pgfault(mm, CAUSE_STORE_PAGE_FAULT, la2) == 0);
+    assert(mm->fault_stat.thp_faults == 2 && mm->fault_stat.faults == 4);
+
+    ptep = get_pte_level(mm->pgdir, la + 7 * PGSIZE, PGLEVEL_4K, 0, &lv);
+    assert(ptep != NULL && lv == PGLEVEL_2M && (*ptep & PTE_W));
+    huge = pte2page(*ptep), huge2 = get_page(mm->pgdir, la2 + PGSIZE, NULL);
+    assert(page_ref(huge) == 1 && page_ref(huge2) == 1 && page2pa(huge) % PTSIZE == 0);
+    for (i = 0; i < PTSIZE / sizeof(size_t); i++)
+    {
+        assert(((size_t *)page2kva(huge))[i] == 0);
+    }
+    for (i = 0; i < nr; i++)
+    {
+        *(size_t *)page2kva(huge + i) = *(size_t *)page2kva(huge2 + i) = i;
+    }
+
+    // mm_mprotect of one page splits the megapage, of the whole of it does not
+    assert(mm_mprotect(mm, la + 3 * PGSIZE, PGSIZE, VM_READ) == 0 && mm->map_count == 3);
+    for (i = 0; i < nr; i++)
+    {
+        assert(get_page(mm->pgdir, la + i * PGSIZE, &ptep) == huge + i && page_ref(huge + i) == 1);
+        assert(*(size_t *)page2kva(huge + i) == i && !(*ptep & PTE_W) == (i == 3));
+    }
+    assert(mm_mprotect(mm, la2, PTSIZE, VM_READ) == 0 && mm->map_count == 5);
+    ptep = get_pte_level(mm->pgdir, la2, PGLEVEL_4K, 0, &lv);
+    assert(lv == PGLEVEL_2M && !(*ptep & PTE_W));
+    assert(mm_mprotect(mm, la2, PTSIZE, VM_READ | VM_WRITE) == 0 && mm->map_count == 3);
+    assert(*ptep & PTE_W);
+
+    // so does mm_unmap of two pages in the middle
+    assert(mm_unmap(mm, la2 + 10 * PGSIZE, 2 * PGSIZE) == 0 && mm->map_count == 4);
+    for (i = 0; i < nr; i++)
+    {
+        page = get_page(mm->pgdir, la2 + i * PGSIZE, NULL);
+        assert((i == 10 || i == 11) ? page == NULL : (page == huge2 + i && *(size_t *)page2kva(page) == i));
+    }
+    assert(do_pgfault(mm, CAUSE_STORE_PAGE_FAULT, la2 + 10 * PGSIZE) == -E_INVAL);
+
+    // mapped again, the first 2 MiB is a megapage once more, until dup_mmap
+    assert(mm_unmap(mm, la, PTSIZE) == 0 && mm->map_count == 3);
+    assert(get_pte(mm->pgdir, la, 0) == NULL);
+    insert_vma_struct(mm, vma_create(la, la2, VM_READ | VM_WRITE));
+    assert(mm->map_count == 2);
+    assert(do_pgfault(mm, CAUSE_STORE_PAGE_FAULT, la) == 0 && mm->fault_stat.thp_faults == 3);
+    huge = get_page(mm->pgdir, la, NULL);
+    *(size_t *)page2kva(huge + 9) = 9;
+
+    struct mm_struct *child = mm_create();
+    assert(child != NULL);
+    child->pgdir = pgdir_create(&(child->kernel_gen));
+    assert(child->pgdir != NULL);
+    assert(dup_mmap(child, mm) == 0);
+    assert(get_pte_level(mm->pgdir, la, PGLEVEL_4K, 0, &lv) != NULL && lv == PGLEVEL_4K);
+    assert(get_page(child->pgdir, la + 9 * PGSIZE, NULL) == huge + 9 && page_ref(huge + 9) == 2);
+    assert(do_pgfault(child, CAUSE_STORE_PAGE_FAULT, la + 9 * PGSIZE) == 0);
+    page = get_page(child->pgdir, la + 9 * PGSIZE, NULL);
+    assert(page != huge + 9 && *(size_t *)page2kva(page) == 9 && child->fault_stat.cow_copies == 1);
+
+    cow_mm_destroy(child);
+    cow_mm_destroy(mm);
+    assert(nr_free_pages_store == nr_free_pages());
+
+    cprintf("check_thp() succeeded!\n");
+}
+
+#ifdef THP_BENCH
+// thp_bench - fault in a vma of more and more megapages' worth with a write
+// per page, then read a word per page four times over, with megapages and
+// with pages only: faults, ticks of each pass, and pages taken. Without
+// megapages every page read misses the TLB once the vma outgrows it. Build
+// with DEFS=-DTHP_BENCH to enable.
+static void
+thp_bench(void)
+{
+    static const size_t sizes[] = {1, 4, 16}; // in megapages
+    uintptr_t la = 0x10000000;
+    uint64_t start, t_fault, t_read;
+    size_t n, i, round, sum, used;
+    int k, thp;
+
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+    {
+        n = sizes[k] * (PTSIZE / PGSIZE);
+        for (thp = 1; thp >= 0; thp--)
+        {
+            size_t nr_free = nr_free_pages();
+            struct mm_struct *mm = cow_mm_create(la, n, 0);
+            thp_enabled = thp;
+            check_mm_struct = mm;
+            switch_pgdir(PADDR(mm->pgdir), &(mm->asid));
+            start = rdtime();
+            for (i = 0; i < n; i++)
+            {
+                *(volatile size_t *)(la + i * PGSIZE) = i;
+            }
+            t_fault = rdtime() - start;
+            start = rdtime();
+            for (round = 0, sum = 0; round < 4; round++)
+            {
+                for (i = 0; i < n; i++)
+                {
+                    sum += *(volatile size_t *)(la + i * PGSIZE);
+                }
+            }
+            t_read = rdtime() - start;
+            assert(sum == 4 * (n * (n - 1) / 2));
+            switch_pgdir(boot_pgdir_pa, NULL);
+            check_mm_struct = NULL;
+            used = nr_free - nr_free_pages();
+            cprintf("thp_bench: %d MiB, %s: %d faults, %d ticks; reads %d ticks; %d pages\n",
+                    (int)(n * PGSIZE >> 20), thp ? "megapages" : "pages", (int)mm->fault_stat.faults,
+                    (int)t_fault, (int)t_read, (int)used);
+            cow_mm_destroy(mm);
+        }
+    }
+    thp_enabled = THP_ENABLED;
+}
+#endif
\ No newline at end of file
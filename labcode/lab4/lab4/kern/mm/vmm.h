@@ -4,6 +4,7 @@
 
 #include <defs.h>
 #include <list.h>
+#include <rbtree.h>
 #include <memlayout.h>
 #include <sync.h>
 
@@ -18,35 +19,113 @@ struct vma_struct {
     uintptr_t vm_end;        // end addr of vma, not include the vm_end itself
     uint32_t vm_flags;       // flags of vma
     list_entry_t list_link;  // linear list link which sorted by start addr of vma
+    rb_node_t rb_link;       // node in the mm's rb-tree of vma, keyed by start addr
 };
 
 #define le2vma(le, member)                  \
     to_struct((le), struct vma_struct, member)
 
+#define rb2vma(node, member)                \
+    rb_entry((node), struct vma_struct, member)
+
 #define VM_READ                 0x00000001
 #define VM_WRITE                0x00000002
 #define VM_EXEC                 0x00000004
 
+// the vma that find_vma found last for a thread, kept in its proc_struct; the
+// entries are only good while seqnum is that of the thread's mm (vmacache_seqnum)
+#define VMACACHE_SIZE           4
+#define VMACACHE_HASH(addr)     (((addr) >> PGSHIFT) & (VMACACHE_SIZE - 1))
+
+struct vmacache {
+    uint64_t seqnum;                        // mm->vmacache_seqnum the entries are from
+    struct vma_struct *vmas[VMACACHE_SIZE]; // by VMACACHE_HASH of the address looked up
+};
+
+struct vmacache_stat {
+    size_t hits;                   // find_vma answered from the thread's vmacache
+    size_t misses;                 // find_vma of a thread that had to search the mm
+};
+
+extern struct vmacache_stat vmacache_stats;
+
+// a fault in a VM_READ|VM_WRITE vma maps the unmapped pages of the aligned
+// window of this many pages around it as well; 1 turns fault-around off
+#define FAULT_AROUND_PAGES      16
+
+// a write or fetch fault where the vma covers the whole aligned 2 MiB around
+// the address, none of it mapped yet, maps all of it with one cleared megapage
+// if an aligned block of pages can be had; a megapage is split back into
+// pages where only part of it is unmapped or mprotected
+#define THP_ENABLED             1
+
+struct mm_fault_stat {
+    size_t faults;                 // page faults do_pgfault resolved
+    size_t around;                 // pages mapped ahead of an access by fault-around
+    size_t fixups;                 // faults on a page already mapped, its pte redone
+    size_t cow_copies;             // writes to a shared page, which got its own copy
+    size_t cow_reuses;             // writes to a page no longer shared, made writable
+    size_t zero_maps;              // ptes a read fault pointed to the shared zero page
+    size_t thp_faults;             // faults that mapped a whole megapage
+    size_t thp_fallbacks;          // megapage faults that got no aligned block, pages instead
+    size_t errors;                 // faults no vma allows, do_pgfault failed them
+};
+
 // the control struct for a set of vma using the same PDT
 struct mm_struct {
     list_entry_t mmap_list;        // linear list link which sorted by start addr of vma
-    struct vma_struct *mmap_cache; // current accessed vma, used for speed purpose
+    rb_root_t mmap_tree;           // the same vma by start addr, once map_count reaches RB_MIN_MAP_COUNT
+    uint64_t vmacache_seqnum;      // changes with every change to the vma, see struct vmacache
     pde_t *pgdir;                  // the PDT of these vma
+    uint64_t asid;                 // ASID and its generation, see switch_pgdir
+    uint64_t kernel_gen;           // kernel half of pgdir as of this generation, see pgdir_sync_kernel
     int map_count;                 // the count of these vma
+    int mm_count;                  // the number of processes sharing this mm (CLONE_VM)
+    struct mm_fault_stat fault_stat; // do_pgfault counters of this mm
     void *sm_priv;                 // the private data for swap manager
 };
 
 struct vma_struct *find_vma(struct mm_struct *mm, uintptr_t addr);
 struct vma_struct *vma_create(uintptr_t vm_start, uintptr_t vm_end, uint32_t vm_flags);
-void insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma);
+struct vma_struct *insert_vma_struct(struct mm_struct *mm, struct vma_struct *vma);
+int vma_split(struct vma_struct *vma, uintptr_t addr);
+int mm_mprotect(struct mm_struct *mm, uintptr_t addr, size_t len, uint32_t vm_flags);
+int mm_unmap(struct mm_struct *mm, uintptr_t addr, size_t len);
 
 struct mm_struct *mm_create(void);
 void mm_destroy(struct mm_struct *mm);
+int dup_mmap(struct mm_struct *to, struct mm_struct *from);
 
 void vmm_init(void);
 
 int do_pgfault(struct mm_struct *mm, uint32_t error_code, uintptr_t addr);
 
+static inline int
+mm_count(struct mm_struct *mm)
+{
+    return mm->mm_count;
+}
+
+static inline void
+set_mm_count(struct mm_struct *mm, int val)
+{
+    mm->mm_count = val;
+}
+
+static inline int
+mm_count_inc(struct mm_struct *mm)
+{
+    mm->mm_count += 1;
+    return mm->mm_count;
+}
+
+static inline int
+mm_count_dec(struct mm_struct *mm)
+{
+    mm->mm_count -= 1;
+    return mm->mm_count;
+}
+
 extern volatile unsigned int pgfault_num;
 extern struct mm_struct *check_mm_struct;
 #endif /* !__KERN_MM_VMM_H__ */
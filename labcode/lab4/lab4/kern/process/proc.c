@@ -119,6 +119,7 @@ alloc_proc(void)
         proc->pgdir = boot_pgdir_pa;        // 页目录：使用内核页目录
         proc->flags = 0;                    // 标志位：清零
         memset(proc->name, 0, PROC_NAME_LEN); // 进程名：清零
+        memset(&(proc->vmacache), 0, sizeof(struct vmacache)); // VMA 缓存：空（seqnum 0 不属于任何 mm）
     }
     return proc;
 }
@@ -206,9 +207,19 @@ void proc_run(struct proc_struct *proc)
         {
             // 切换当前进程为要运行的进程
             current = proc;
-            // 切换页表，以便使用新进程的地址空间
-            lsatp(proc->pgdir);
+            // 切换页表，以便使用新进程的地址空间：带 ASID 写 satp，不刷 TLB；
+            // 内核线程（mm == NULL）只用内核映射，而每个页表里都有，直接沿用
+            // 当前 satp（lazy TLB），连 satp 都不写。页表的内核部分与 boot_pgdir
+            // 共享下层页表，换入前先补上落后的内核根目录项
+            if (proc->mm != NULL)
+            {
+                pgdir_sync_kernel(proc->mm->pgdir, &(proc->mm->kernel_gen));
+                switch_pgdir(proc->pgdir, &(proc->mm->asid));
+            }
             // 实现上下文切换，保存当前进程状态并恢复目标进程状态
+            // 内核只在 rvv_string.S 的例程里打开 sstatus.VS，例程关着中断，例程里
+            // 出的缺页也不会走到调度，这里不会有向量状态要保存
+            assert((read_csr(sstatus) & SSTATUS_VS) == 0);
             switch_to(&(prev->context), &(proc->context));
         }
         // 恢复中断
@@ -287,12 +298,50 @@ put_kstack(struct proc_struct *proc)
 
 // copy_mm - process "proc" duplicate OR share process "current"'s mm according clone_flags
 //         - if clone_flags & CLONE_VM, then "share" ; else "duplicate"
+//         - duplicate 时页面不复制，父子进程只读共享（引用计数 +1），
+//           谁先写谁在缺页中拿到自己的副本（写时复制，见 do_pgfault）
 static int
 copy_mm(uint32_t clone_flags, struct proc_struct *proc)
 {
-    assert(current->mm == NULL);
-    /* do nothing in this project */
+    struct mm_struct *mm, *oldmm = current->mm;
+
+    /* current is a kernel thread */
+    if (oldmm == NULL)
+    {
+        return 0;
+    }
+    if (clone_flags & CLONE_VM)
+    {
+        mm = oldmm;
+        goto good_mm;
+    }
+
+    int ret = -E_NO_MEM;
+    if ((mm = mm_create()) == NULL)
+    {
+        goto bad_mm;
+    }
+    // 新页表：内核部分与 boot_pgdir 共享，用户部分由 dup_mmap 填入
+    if ((mm->pgdir = pgdir_create(&(mm->kernel_gen))) == NULL)
+    {
+        goto bad_pgdir_cleanup_mm;
+    }
+    if ((ret = dup_mmap(mm, oldmm)) != 0)
+    {
+        goto bad_dup_cleanup_mmap;
+    }
+
+good_mm:
+    mm_count_inc(mm);
+    proc->mm = mm;
+    proc->pgdir = PADDR(mm->pgdir);
     return 0;
+bad_dup_cleanup_mmap:
+    pgdir_destroy(mm->pgdir);
+bad_pgdir_cleanup_mm:
+    mm_destroy(mm);
+bad_mm:
+    return ret;
 }
 
 // copy_thread - setup the trapframe on the  process's kernel stack top and
@@ -480,5 +529,10 @@ void cpu_idle(void)
         {
             schedule();
         }
+        else
+        {
+            // nothing to run, clear a page for alloc_zeroed_page meanwhile
+            zero_pool_refill();
+        }
     }
 }
@@ -6,6 +6,7 @@
 #include <list.h>
 #include <trap.h>
 #include <memlayout.h>
+#include <vmm.h>
 
 // process's state in his life cycle
 enum proc_state
@@ -55,6 +56,7 @@ struct proc_struct {
     char name[PROC_NAME_LEN + 1];           // 进程名（结尾 '\0'），用于日志/调试
     list_entry_t list_link;                 // 双向链表节点：挂到全局进程表/就绪队列等
     list_entry_t hash_link;                 // 双向链表节点：挂到按 pid 的哈希桶，便于 O(1) 查找
+    struct vmacache vmacache;               // 本线程最近 find_vma 找到的几个 VMA，mm 的映射一变即作废
 };
 
 
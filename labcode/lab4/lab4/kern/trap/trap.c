@@ -9,7 +9,9 @@
 #include <stdio.h>
 #include <trap.h>
 #include <vmm.h>
+#include <proc.h>
 #include <sbi.h>
+#include <riscv_string.h>
 
 #define TICK_NUM 100
 
@@ -156,6 +158,23 @@ void interrupt_handler(struct trapframe *tf)
     }
 }
 
+// pgfault_handler - resolve a page fault in check_mm_struct while the vmm
+// checks run, otherwise in the address space of the current process
+static int pgfault_handler(struct trapframe *tf)
+{
+    struct mm_struct *mm = check_mm_struct;
+    if (mm == NULL && current != NULL)
+    {
+        mm = current->mm;
+    }
+    if (mm == NULL)
+    {
+        print_trapframe(tf);
+        panic("unhandled page fault.\n");
+    }
+    return do_pgfault(mm, tf->cause, tf->badvaddr);
+}
+
 void exception_handler(struct trapframe *tf)
 {
     int ret;
@@ -199,13 +218,16 @@ void exception_handler(struct trapframe *tf)
         cprintf("Environment call from M-mode\n");
         break;
     case CAUSE_FETCH_PAGE_FAULT:
-        cprintf("Instruction page fault\n");
-        break;
     case CAUSE_LOAD_PAGE_FAULT:
-        cprintf("Load page fault\n");
-        break;
     case CAUSE_STORE_PAGE_FAULT:
-        cprintf("Store/AMO page fault\n");
+        // 缺页：由 do_pgfault 按 VMA 建立映射，失败才打印并停机
+        if ((ret = pgfault_handler(tf)) != 0)
+        {
+            cprintf("%s page fault\n", tf->cause == CAUSE_FETCH_PAGE_FAULT ? "Instruction"
+                                       : tf->cause == CAUSE_LOAD_PAGE_FAULT ? "Load" : "Store/AMO");
+            print_trapframe(tf);
+            panic("handle pgfault failed. %e\n", ret);
+        }
         break;
     default:
         print_trapframe(tf);
@@ -221,6 +243,14 @@ void exception_handler(struct trapframe *tf)
  * */
 void trap(struct trapframe *tf)
 {
+    // rvv_string.S 的例程关着中断，能打断它们的只有同步异常，如 vle8/vse8 缺页。
+    // 这时例程的向量寄存器和 vl/vtype 还活着，而 trapentry.S 不保存向量状态：
+    // 处理期间 string.h 退回标量实现，不碰向量状态，sret 后例程从 vstart 接着做
+    bool rvv = __rvv_enabled;
+    if (tf->status & SSTATUS_VS)
+    {
+        __rvv_enabled = 0;
+    }
     // dispatch based on what type of trap occurred
     if ((intptr_t)tf->cause < 0)
     {
@@ -232,4 +262,5 @@ void trap(struct trapframe *tf)
         // exceptions
         exception_handler(tf);
     }
+    __rvv_enabled = rvv;
 }
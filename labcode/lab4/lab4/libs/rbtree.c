@@ -0,0 +1,316 @@
+#include <rbtree.h>
+
+/* *
+ * rb_rotate_left - rotate @node down to the left, its right child takes
+ * its place
+ * */
+static void
+rb_rotate_left(rb_node_t *node, rb_root_t *root) {
+    rb_node_t *right = node->right, *parent = node->parent;
+    if ((node->right = right->left) != NULL) {
+        right->left->parent = node;
+    }
+    right->left = node;
+    right->parent = parent;
+    if (parent == NULL) {
+        root->node = right;
+    } else if (parent->left == node) {
+        parent->left = right;
+    } else {
+        parent->right = right;
+    }
+    node->parent = right;
+}
+
+/* *
+ * rb_rotate_right - rotate @node down to the right, its left child takes
+ * its place
+ * */
+static void
+rb_rotate_right(rb_node_t *node, rb_root_t *root) {
+    rb_node_t *left = node->left, *parent = node->parent;
+    if ((node->left = left->right) != NULL) {
+        left->right->parent = node;
+    }
+    left->right = node;
+    left->parent = parent;
+    if (parent == NULL) {
+        root->node = left;
+    } else if (parent->right == node) {
+        parent->right = left;
+    } else {
+        parent->left = left;
+    }
+    node->parent = left;
+}
+
+/* *
+ * rb_insert_color - rebalance the tree after @node was linked in by
+ * rb_link_node
+ * */
+void
+rb_insert_color(rb_node_t *node, rb_root_t *root) {
+    rb_node_t *parent, *gparent, *uncle, *tmp;
+    while ((parent = node->parent) != NULL && parent->red) {
+        gparent = parent->parent;
+        if (parent == gparent->left) {
+            uncle = gparent->right;
+            if (uncle != NULL && uncle->red) {
+                uncle->red = parent->red = 0;
+                gparent->red = 1;
+                node = gparent;
+                continue;
+            }
+            if (parent->right == node) {
+                rb_rotate_left(parent, root);
+                tmp = parent, parent = node, node = tmp;
+            }
+            parent->red = 0;
+            gparent->red = 1;
+            rb_rotate_right(gparent, root);
+        } else {
+            uncle = gparent->left;
+            if (uncle != NULL && uncle->red) {
+                uncle->red = parent->red = 0;
+                gparent->red = 1;
+                node = gparent;
+                continue;
+            }
+            if (parent->left == node) {
+                rb_rotate_right(parent, root);
+                tmp = parent, parent = node, node = tmp;
+            }
+            parent->red = 0;
+            gparent->red = 1;
+            rb_rotate_left(gparent, root);
+        }
+    }
+    root->node->red = 0;
+}
+
+/* *
+ * rb_erase_color - restore the black height after a black node was
+ * removed above @node (which may be NULL), @parent is its parent
+ * */
+static void
+rb_erase_color(rb_node_t *node, rb_node_t *parent, rb_root_t *root) {
+    rb_node_t *other;
+    while ((node == NULL || !node->red) && node != root->node) {
+        if (parent->left == node) {
+            other = parent->right;
+            if (other->red) {
+                other->red = 0;
+                parent->red = 1;
+                rb_rotate_left(parent, root);
+                other = parent->right;
+            }
+            if ((other->left == NULL || !other->left->red) &&
+                (other->right == NULL || !other->right->red)) {
+                other->red = 1;
+                node = parent;
+                parent = node->parent;
+            } else {
+                if (other->right == NULL || !other->right->red) {
+                    other->left->red = 0;
+                    other->red = 1;
+                    rb_rotate_right(other, root);
+                    other = parent->right;
+                }
+                other->red = parent->red;
+                parent->red = 0;
+                other->right->red = 0;
+                rb_rotate_left(parent, root);
+                node = root->node;
+                break;
+            }
+        } else {
+            other = parent->left;
+            if (other->red) {
+                other->red = 0;
+                parent->red = 1;
+                rb_rotate_right(parent, root);
+                other = parent->left;
+            }
+            if ((other->left == NULL || !other->left->red) &&
+                (other->right == NULL || !other->right->red)) {
+                other->red = 1;
+                node = parent;
+                parent = node->parent;
+            } else {
+                if (other->left == NULL || !other->left->red) {
+                    other->right->red = 0;
+                    other->red = 1;
+                    rb_rotate_left(other, root);
+                    other = parent->left;
+                }
+                other->red = parent->red;
+                parent->red = 0;
+                other->left->red = 0;
+                rb_rotate_right(parent, root);
+                node = root->node;
+                break;
+            }
+        }
+    }
+    if (node != NULL) {
+        node->red = 0;
+    }
+}
+
+/* *
+ * rb_erase - unlink @node from the tree and rebalance
+ * */
+void
+rb_erase(rb_node_t *node, rb_root_t *root) {
+    rb_node_t *child, *parent;
+    bool red;
+    if (node->left == NULL) {
+        child = node->right;
+    } else if (node->right == NULL) {
+        child = node->left;
+    } else {
+        // two children: the in-order successor takes over @node's place
+        rb_node_t *old = node, *left;
+        node = node->right;
+        while ((left = node->left) != NULL) {
+            node = left;
+        }
+        if (old->parent == NULL) {
+            root->node = node;
+        } else if (old->parent->left == old) {
+            old->parent->left = node;
+        } else {
+            old->parent->right = node;
+        }
+
+        child = node->right;
+        parent = node->parent;
+        red = node->red;
+
+        if (parent == old) {
+            parent = node;
+        } else {
+            if (child != NULL) {
+                child->parent = parent;
+            }
+            parent->left = child;
+            node->right = old->right;
+            old->right->parent = node;
+        }
+
+        node->parent = old->parent;
+        node->red = old->red;
+        node->left = old->left;
+        old->left->parent = node;
+        goto color;
+    }
+
+    parent = node->parent;
+    red = node->red;
+    if (child != NULL) {
+        child->parent = parent;
+    }
+    if (parent == NULL) {
+        root->node = child;
+    } else if (parent->left == node) {
+        parent->left = child;
+    } else {
+        parent->right = child;
+    }
+
+color:
+    if (!red) {
+        rb_erase_color(child, parent, root);
+    }
+}
+
+/* *
+ * rb_replace_node - put @node into @victim's place without rebalancing
+ *
+ * The caller must make sure @node sorts to the same position as @victim.
+ * */
+void
+rb_replace_node(rb_node_t *victim, rb_node_t *node, rb_root_t *root) {
+    rb_node_t *parent = victim->parent;
+    if (parent == NULL) {
+        root->node = node;
+    } else if (parent->left == victim) {
+        parent->left = node;
+    } else {
+        parent->right = node;
+    }
+    if (victim->left != NULL) {
+        victim->left->parent = node;
+    }
+    if (victim->right != NULL) {
+        victim->right->parent = node;
+    }
+    *node = *victim;
+}
+
+/* *
+ * rb_first - get the leftmost (smallest) node, NULL if the tree is empty
+ * */
+rb_node_t *
+rb_first(const rb_root_t *root) {
+    rb_node_t *node = root->node;
+    if (node != NULL) {
+        while (node->left != NULL) {
+            node = node->left;
+        }
+    }
+    return node;
+}
+
+/* *
+ * rb_last - get the rightmost (largest) node, NULL if the tree is empty
+ * */
+rb_node_t *
+rb_last(const rb_root_t *root) {
+    rb_node_t *node = root->node;
+    if (node != NULL) {
+        while (node->right != NULL) {
+            node = node->right;
+        }
+    }
+    return node;
+}
+
+/* *
+ * rb_next - get the in-order successor of @node, NULL if it is the last
+ * */
+rb_node_t *
+rb_next(const rb_node_t *node) {
+    rb_node_t *parent;
+    if (node->right != NULL) {
+        node = node->right;
+        while (node->left != NULL) {
+            node = node->left;
+        }
+        return (rb_node_t *)node;
+    }
+    while ((parent = node->parent) != NULL && node == parent->right) {
+        node = parent;
+    }
+    return parent;
+}
+
+/* *
+ * rb_prev - get the in-order predecessor of @node, NULL if it is the first
+ * */
+rb_node_t *
+rb_prev(const rb_node_t *node) {
+    rb_node_t *parent;
+    if (node->left != NULL) {
+        node = node->left;
+        while (node->right != NULL) {
+            node = node->right;
+        }
+        return (rb_node_t *)node;
+    }
+    while ((parent = node->parent) != NULL && node == parent->left) {
+        node = parent;
+    }
+    return parent;
+}
+
@@ -0,0 +1,83 @@
+#ifndef __LIBS_RBTREE_H__
+#define __LIBS_RBTREE_H__
+
+#ifndef __ASSEMBLER__
+
+#include <defs.h>
+
+/* *
+ * Intrusive red-black tree.
+ *
+ * Like list.h, the tree does not own its elements: a struct rb_node is
+ * embedded in the element, and rb_entry() converts a node back to the
+ * element. The tree does not know the key either. To insert, the caller
+ * descends from root->node comparing its own keys, then calls
+ * rb_link_node() with the parent and child slot it stopped at, and finally
+ * rb_insert_color() to rebalance:
+ *
+ *     rb_node_t **link = &root->node, *parent = NULL;
+ *     while (*link != NULL) {
+ *         parent = *link;
+ *         link = (key < key_of(parent)) ? &parent->left : &parent->right;
+ *     }
+ *     rb_link_node(&elm->node, parent, link);
+ *     rb_insert_color(&elm->node, root);
+ * */
+
+struct rb_node {
+    struct rb_node *parent, *left, *right;
+    bool red;
+};
+
+struct rb_root {
+    struct rb_node *node;
+};
+
+typedef struct rb_node rb_node_t;
+typedef struct rb_root rb_root_t;
+
+#define rb_entry(node, type, member)        \
+    to_struct((node), type, member)
+
+void rb_insert_color(rb_node_t *node, rb_root_t *root);
+void rb_erase(rb_node_t *node, rb_root_t *root);
+void rb_replace_node(rb_node_t *victim, rb_node_t *node, rb_root_t *root);
+
+rb_node_t *rb_first(const rb_root_t *root);
+rb_node_t *rb_last(const rb_root_t *root);
+rb_node_t *rb_next(const rb_node_t *node);
+rb_node_t *rb_prev(const rb_node_t *node);
+
+/* *
+ * rb_root_init - initialize an empty tree
+ * */
+static inline void
+rb_root_init(rb_root_t *root) {
+    root->node = NULL;
+}
+
+/* *
+ * rb_empty - tests whether a tree is empty
+ * */
+static inline bool
+rb_empty(const rb_root_t *root) {
+    return root->node == NULL;
+}
+
+/* *
+ * rb_link_node - hang a new red leaf @node below @parent
+ * @link:       the empty child slot of @parent (or &root->node) found by
+ *              the caller's descent
+ * */
+static inline void
+rb_link_node(rb_node_t *node, rb_node_t *parent, rb_node_t **link) {
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->red = 1;
+    *link = node;
+}
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !__LIBS_RBTREE_H__ */
+
@@ -47,6 +47,8 @@
 #define SSTATUS_UPIE 0x00000010
 #define SSTATUS_SPIE 0x00000020
 #define SSTATUS_SPP 0x00000100
+#define SSTATUS_VS 0x00000600
+#define SSTATUS_VS_INITIAL 0x00000200
 #define SSTATUS_FS 0x00006000
 #define SSTATUS_XS 0x00018000
 #define SSTATUS_SUM 0x00040000